@@ -85,18 +85,15 @@ void loop()
         }
         lastMeasurementTimeMs = millis();
 
-        uptBleServer.writeValueToCurrentSample(
-            temperature, core::SignalType::TEMPERATURE_DEGREES_CELSIUS);
-        uptBleServer.writeValueToCurrentSample(
-            humidity, core::SignalType::RELATIVE_HUMIDITY_PERCENTAGE);
-        uptBleServer.writeValueToCurrentSample(
-            co2, core::SignalType::CO2_PARTS_PER_MILLION);
-        uptBleServer.writeValueToCurrentSample(
-            massConcentrationPm2p5, core::SignalType::PM2P5_MICRO_GRAMM_PER_CUBIC_METER);
-        uptBleServer.writeValueToCurrentSample(
-            vocIndex, core::SignalType::VOC_INDEX);
-        uptBleServer.writeValueToCurrentSample(
-            noxIndex, core::SignalType::NOX_INDEX);
+        uptBleServer.writeValuesToCurrentSample({
+            {core::SignalType::TEMPERATURE_DEGREES_CELSIUS, temperature},
+            {core::SignalType::RELATIVE_HUMIDITY_PERCENTAGE, humidity},
+            {core::SignalType::CO2_PARTS_PER_MILLION, static_cast<float>(co2)},
+            {core::SignalType::PM2P5_MICRO_GRAMM_PER_CUBIC_METER,
+             massConcentrationPm2p5},
+            {core::SignalType::VOC_INDEX, vocIndex},
+            {core::SignalType::NOX_INDEX, noxIndex},
+        });
 
         uptBleServer.commitSample();
     }
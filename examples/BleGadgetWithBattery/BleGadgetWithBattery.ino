@@ -22,6 +22,16 @@ void setup() {
   // Register battery ble services
   uptBleServer.registerBleServiceProvider(batteryBleService);
 
+  // Download at the shortest connection interval, save power while idle
+  ble_server::ConnectionParameters downloadParameters;
+  ble_server::ConnectionParameters idleParameters;
+  idleParameters.minIntervalMs = 200;
+  idleParameters.maxIntervalMs = 400;
+  idleParameters.latency = 4;
+  idleParameters.supervisionTimeoutMs = 6000;
+  uptBleServer.setAdaptiveConnectionParameters(downloadParameters,
+                                               idleParameters);
+
   // Initialize the GadgetBle Library
   uptBleServer.begin();
 
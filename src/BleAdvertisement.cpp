@@ -1,5 +1,8 @@
 #include "BleAdvertisement.h"
 
+#include <algorithm>
+#include <cstdlib>
+
 namespace sensirion::upt::ble_server {
 
 void BleAdvertisement::begin() {
@@ -16,28 +19,116 @@ void BleAdvertisement::begin() {
       static_cast<uint8_t>(
           strtol(macAddress.substr(15, 17).c_str(), nullptr, 16)));
 
-  Sample initialSample;
-  mAdvertisementLibrary.setAdvertisingData(
-      buildAdvertisementData(initialSample));
-  mAdvertisementLibrary.startAdvertising();
+  writeHeader();
+  updateEncodedDeadbands();
+  writeSample(Sample());
+  restartAdvertising();
+  mLatestUpdateMs = millis();
 }
 
 void BleAdvertisement::setSampleConfig(const core::SampleConfig &sampleConfig) {
   mSampleConfig = sampleConfig;
+  writeHeader();
+  updateEncodedDeadbands();
+  // the new header goes out with the next commit, even an unchanged one
+  mDirty = true;
 }
 
-void BleAdvertisement::commitSample(Sample &sample) {
-  // Update Advertising
-  mAdvertisementLibrary.stopAdvertising();
-  mAdvertisementLibrary.setAdvertisingData(buildAdvertisementData(sample));
-  mAdvertisementLibrary.startAdvertising();
+void BleAdvertisement::setChangeFilter(const bool enable,
+                                       const uint32_t maxStalenessMs) {
+  mChangeFilter = enable;
+  mMaxStalenessMs = maxStalenessMs;
 }
 
-std::string BleAdvertisement::buildAdvertisementData(Sample &sample) {
+void BleAdvertisement::setDeadband(const core::SignalType signalType,
+                                   const float deadband) {
+  mDeadbands[signalType] = deadband;
+  updateEncodedDeadbands();
+}
+
+void BleAdvertisement::commitSample(const Sample &sample) {
+  const uint32_t now = millis();
+  if (mChangeFilter && !mDirty && now - mLatestUpdateMs < mMaxStalenessMs &&
+      !hasChanged(sample)) {
+    return;
+  }
+  mDirty = false;
+  mLatestUpdateMs = now;
+  writeSample(sample);
+  if (mAdvertisementLibrary.updateAdvertisingData(mAdvertisementData.data(),
+                                                  mAdvertisementData.size())) {
+    return;
+  }
+  restartAdvertising();
+}
+
+void BleAdvertisement::writeHeader() {
   mAdvertisementHeader.writeSampleType(mSampleConfig.sampleType);
-  std::string data = mAdvertisementHeader.getDataString();
-  data.append(sample.getDataString());
-  return data;
+  const auto &header = mAdvertisementHeader.getDataArray();
+  std::copy(header.begin(), header.end(), mAdvertisementData.begin());
+}
+
+void BleAdvertisement::writeSample(const Sample &sample) {
+  // slots beyond the advertised bytes are only part of the history
+  const auto &data = sample.getDataArray();
+  std::copy(data.begin(), data.begin() + ADVERTISED_SAMPLE_SIZE_BYTES,
+            &mAdvertisementData[ADVERTISEMENT_HEADER_SIZE_BYTES]);
+}
+
+void BleAdvertisement::updateEncodedDeadbands() {
+  std::fill(std::begin(mEncodedDeadbands), std::end(mEncodedDeadbands), 0);
+  mSignedValues = 0;
+  for (const auto &[signalType, slot] : mSampleConfig.sampleSlots) {
+    const size_t slotIndex = slot.offset / 2;
+    if (!slot.encodingFunction || slotIndex >= ADVERTISED_SLOTS) {
+      continue;
+    }
+    const uint16_t encodedZero = slot.encodingFunction(0.0f);
+    // as in the history tiers, a negative value encoded above 0 is signed
+    if (slot.encodingFunction(-1.0f) > encodedZero) {
+      mSignedValues |= 1 << slotIndex;
+    }
+    const auto deadband = mDeadbands.find(signalType);
+    if (deadband == mDeadbands.end()) {
+      continue;
+    }
+    // the encodings are affine, the offset cancels out
+    const int32_t encodedDeadband =
+        slot.encodingFunction(deadband->second) - encodedZero;
+    mEncodedDeadbands[slotIndex] =
+        static_cast<uint16_t>(std::abs(encodedDeadband));
+  }
+}
+
+bool BleAdvertisement::hasChanged(const Sample &sample) const {
+  const uint8_t *advertised =
+      &mAdvertisementData[ADVERTISEMENT_HEADER_SIZE_BYTES];
+  const uint8_t *data = sample.getDataArray().data();
+  for (size_t slotIndex = 0; slotIndex < ADVERTISED_SLOTS; ++slotIndex) {
+    const size_t offset = 2 * slotIndex;
+    const uint16_t oldValue = advertised[offset] | advertised[offset + 1] << 8;
+    const uint16_t newValue = data[offset] | data[offset + 1] << 8;
+    int32_t difference;
+    if (mSignedValues & (1 << slotIndex)) {
+      difference = static_cast<int16_t>(newValue) -
+                   static_cast<int16_t>(oldValue);
+    } else {
+      difference = newValue - oldValue;
+    }
+    if (static_cast<uint32_t>(std::abs(difference)) >
+        mEncodedDeadbands[slotIndex]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void BleAdvertisement::restartAdvertising() {
+  mAdvertisementLibrary.stopAdvertising();
+  mAdvertisementLibrary.setAdvertisingData(
+      std::string(reinterpret_cast<const char *>(mAdvertisementData.data()),
+                  mAdvertisementData.size()));
+  mAdvertisementLibrary.startAdvertising();
 }
 
 } // namespace sensirion::upt::ble_server
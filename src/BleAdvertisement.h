@@ -5,8 +5,15 @@
 #include "IBleAdvertisementLibrary.h"
 #include "Sample.h"
 
+#include <array>
+#include <map>
+
 namespace sensirion::upt::ble_server {
 
+static constexpr size_t ADVERTISEMENT_DATA_SIZE_BYTES =
+    ADVERTISEMENT_HEADER_SIZE_BYTES + ADVERTISED_SAMPLE_SIZE_BYTES;
+static constexpr size_t ADVERTISED_SLOTS = ADVERTISED_SAMPLE_SIZE_BYTES / 2;
+
 class BleAdvertisement {
 public:
   explicit BleAdvertisement(
@@ -20,15 +27,45 @@ public:
   void begin();
 
   void setSampleConfig(const core::SampleConfig &sampleConfig);
-  void commitSample(Sample &sample);
+  // Updates the running advertisement with the sample, unless the change
+  // filter is enabled and no value moved beyond its deadband
+  void commitSample(const Sample &sample);
+  // Only advertise samples with a changed value, but at least every
+  // maxStalenessMs
+  void setChangeFilter(bool enable, uint32_t maxStalenessMs);
+  // Changes of the signal up to deadband are not advertised with the change
+  // filter enabled, by default any change is
+  void setDeadband(core::SignalType signalType, float deadband);
 
 private:
   core::SampleConfig mSampleConfig;
   IBleAdvertisementLibrary &mAdvertisementLibrary;
   AdvertisementHeader mAdvertisementHeader;
+  // header followed by the sample, only the sample is rewritten per commit
+  std::array<uint8_t, ADVERTISEMENT_DATA_SIZE_BYTES> mAdvertisementData{};
+  bool mChangeFilter = false;
+  uint32_t mMaxStalenessMs = 0;
+  uint32_t mLatestUpdateMs = 0;
+  bool mDirty = false; // the header changed since the latest update
+  std::map<core::SignalType, float> mDeadbands;
+  // deadbands and signedness of the encoded 16 bit values of the sample
+  uint16_t mEncodedDeadbands[ADVERTISED_SLOTS] = {};
+  uint16_t mSignedValues = 0;
 
 private:
-  std::string buildAdvertisementData(Sample &sample);
+  void writeHeader();
+
+  void writeSample(const Sample &sample);
+
+  // Encodes the deadbands for the slots of the sample config
+  void updateEncodedDeadbands();
+
+  // True if a value of the sample differs from the advertised one by more
+  // than its deadband
+  [[nodiscard]] bool hasChanged(const Sample &sample) const;
+
+  // Sets the data on a stopped advertisement and starts it again
+  void restartAdvertising();
 };
 
 } // namespace sensirion::upt::ble_server
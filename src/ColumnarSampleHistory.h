@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef COLUMNAR_SAMPLE_HISTORY_H
+#define COLUMNAR_SAMPLE_HISTORY_H
+
+#include "ByteArray.h"
+#include "Sample.h"
+#include "SampleHistoryRingBuffer.h"
+#include "SampleOverflowBuffer.h"
+
+#include <cstring>
+
+namespace sensirion::upt::ble_server {
+
+// Min, max and sum of the values of a slot over a range of samples
+struct SlotStatistics {
+  int32_t min = 0;
+  int32_t max = 0;
+  int64_t sum = 0;
+  uint32_t count = 0;
+};
+
+// SampleHistoryRingBuffer storing each 16 bit slot in its own contiguous
+// ring, so scans over the values of one signal do not stride through whole
+// samples. A trailing byte of an odd sample size takes a column of its own.
+// Samples are put and read out row wise as with the other histories.
+template <size_t BUFFER_SIZE = SAMPLE_HISTORY_RING_BUFFER_SIZE_BYTES,
+          size_t OVERFLOW_BUFFER_SIZE = SAMPLE_OVERFLOW_BUFFER_SIZE_BYTES>
+class ColumnarSampleHistory : protected ByteArray<BUFFER_SIZE> {
+public:
+  void putSample(const Sample &sample) {
+    putRecord(sample.getDataArray().data());
+  };
+
+  // Stores sample size bytes from record, which may be larger than a Sample
+  void putRecord(const uint8_t *record) {
+    if (mCapacity == 0) {
+      return;
+    }
+    if (mReadOutPinned && mCount == mCapacity && mHead == mReadOutStart &&
+        mReadOutCount > 0) {
+      if (mOverflow.put(record)) {
+        return;
+      }
+      // the overflow buffer is full too, give up the pinned range
+      mReadOutInvalidated = true;
+      endReadOut();
+    }
+    for (size_t offset = 0; offset < mSampleSizeBytes; offset += 2) {
+      uint8_t *value = column(offset) + 2 * mHead;
+      value[0] = record[offset];
+      value[1] = offset + 1 < mSampleSizeBytes ? record[offset + 1] : 0;
+    }
+    mHead = (mHead + 1) % mCapacity;
+    if (mCount < mCapacity) {
+      ++mCount;
+    }
+  };
+
+  bool setSampleSize(const size_t sampleSize) {
+    mSampleSizeBytes = sampleSize;
+    // columns are 2 bytes wide, also the one of a trailing byte
+    const size_t columnsSize = (sampleSize + 1) / 2 * 2;
+    mCapacity = columnsSize == 0 ? 0 : BUFFER_SIZE / columnsSize;
+    mOverflow.setSampleSize(sampleSize);
+    reset();
+    return true;
+  };
+
+  [[nodiscard]] uint32_t numberOfSamplesInHistory() const { return mCount; };
+
+  void startReadOut(const uint32_t nrOfSamples) {
+    mReadOutPinned = true;
+    mReadOutInvalidated = false;
+    mReadOutCount = nrOfSamples < mCount ? nrOfSamples : mCount;
+    mReadOutStart = positionBack(mReadOutCount);
+    mReadOutNext = 0;
+    mReadOutByteOffset = 0;
+  };
+
+  // Releases the pinned range and adds the samples held back meanwhile
+  void endReadOut() {
+    mReadOutPinned = false;
+    while (!mOverflow.isEmpty()) {
+      putRecord(mOverflow.front());
+      mOverflow.pop();
+    }
+  };
+
+  // True if the pinned range had to be overwritten since startReadOut
+  [[nodiscard]] bool readOutInvalidated() const {
+    return mReadOutInvalidated;
+  };
+
+  // Moves the read out to the given byte offset from the start of the range
+  // given to startReadOut, e.g. to send parts of a download again
+  void seekReadOut(const size_t byteOffset) {
+    if (mSampleSizeBytes == 0) {
+      return;
+    }
+    mReadOutNext = byteOffset / mSampleSizeBytes;
+    mReadOutByteOffset = byteOffset % mSampleSizeBytes;
+  };
+
+  // Number of samples left until the read out reaches the end of its range
+  [[nodiscard]] uint32_t numberOfSamplesToReadOut() const {
+    const uint32_t count = readOutCount();
+    return mReadOutNext < count ? count - mReadOutNext : 0;
+  };
+
+  // Copies up to maxBytes of the read out range to destination, the samples
+  // are gathered from the columns
+  size_t readOutNextBytes(uint8_t *destination, const size_t maxBytes) {
+    uint8_t sample[MAX_SAMPLE_SIZE_BYTES];
+    size_t count = 0;
+    while (count < maxBytes && numberOfSamplesToReadOut() > 0) {
+      readSample((mReadOutStart + mReadOutNext) % mCapacity, sample);
+      size_t bytes = mSampleSizeBytes - mReadOutByteOffset;
+      if (bytes > maxBytes - count) {
+        bytes = maxBytes - count;
+      }
+      memcpy(&destination[count], &sample[mReadOutByteOffset], bytes);
+      count += bytes;
+      mReadOutByteOffset += bytes;
+      if (mReadOutByteOffset == mSampleSizeBytes) {
+        mReadOutByteOffset = 0;
+        ++mReadOutNext;
+      }
+    }
+    return count;
+  };
+
+  // Copies up to maxSamples samples of the read out range to destination
+  size_t readOutNextSamples(uint8_t *destination, const size_t maxSamples) {
+    if (mSampleSizeBytes == 0) {
+      return 0;
+    }
+    return readOutNextBytes(destination, maxSamples * mSampleSizeBytes) /
+           mSampleSizeBytes;
+  };
+
+  // Copies the values of the slot at slotIndex of up to nrOfSamples latest
+  // samples to destination, oldest first. Returns the number of values.
+  size_t copySlotValues(const size_t slotIndex, const uint32_t nrOfSamples,
+                        uint16_t *destination) const {
+    size_t count = 0;
+    forEachSegment(slotIndex, nrOfSamples,
+                   [destination, &count](const uint8_t *values,
+                                         const size_t size) {
+                     for (size_t i = 0; i < size; ++i) {
+                       destination[count++] =
+                           values[2 * i] | values[2 * i + 1] << 8;
+                     }
+                   });
+    return count;
+  };
+
+  // Statistics of the slot at slotIndex over up to nrOfSamples latest
+  // samples, with the values read as two's complement if isSigned
+  [[nodiscard]] SlotStatistics slotStatistics(const size_t slotIndex,
+                                              const uint32_t nrOfSamples,
+                                              const bool isSigned) const {
+    if (isSigned) {
+      return statistics<int16_t>(slotIndex, nrOfSamples);
+    }
+    return statistics<uint16_t>(slotIndex, nrOfSamples);
+  };
+
+  void reset() {
+    mHead = 0;
+    mCount = 0;
+    mReadOutStart = 0;
+    mReadOutCount = 0;
+    mReadOutNext = 0;
+    mReadOutByteOffset = 0;
+    mReadOutPinned = false;
+    mReadOutInvalidated = false;
+    mOverflow.reset();
+  };
+
+private:
+  // Column of the slot at the given byte offset in the sample
+  [[nodiscard]] uint8_t *column(const size_t offset) {
+    return &this->mData[offset * mCapacity];
+  };
+  [[nodiscard]] const uint8_t *column(const size_t offset) const {
+    return &this->mData[offset * mCapacity];
+  };
+
+  // The read out range ends with the latest sample unless it is pinned
+  [[nodiscard]] uint32_t readOutCount() const {
+    if (mReadOutPinned || mCapacity == 0) {
+      return mReadOutCount;
+    }
+    return (mHead + mCapacity - mReadOutStart) % mCapacity;
+  };
+
+  // Position of the sample count samples before the head
+  [[nodiscard]] uint32_t positionBack(const uint32_t count) const {
+    return (mHead + mCapacity - count) % mCapacity;
+  };
+
+  void readSample(const uint32_t position, uint8_t *sample) const {
+    for (size_t offset = 0; offset < mSampleSizeBytes; offset += 2) {
+      const uint8_t *value = column(offset) + 2 * position;
+      sample[offset] = value[0];
+      if (offset + 1 < mSampleSizeBytes) {
+        sample[offset + 1] = value[1];
+      }
+    }
+  };
+
+  // Calls function with the contiguous parts of the slot's column holding
+  // the values of the latest nrOfSamples samples, oldest first
+  template <typename Function>
+  void forEachSegment(const size_t slotIndex, uint32_t nrOfSamples,
+                      Function function) const {
+    if (2 * slotIndex >= mSampleSizeBytes || mCount == 0) {
+      return;
+    }
+    if (nrOfSamples > mCount) {
+      nrOfSamples = mCount;
+    }
+    const uint8_t *values = column(2 * slotIndex);
+    const uint32_t start = positionBack(nrOfSamples);
+    const uint32_t untilWrap = mCapacity - start;
+    if (nrOfSamples <= untilWrap) {
+      function(&values[2 * start], nrOfSamples);
+      return;
+    }
+    function(&values[2 * start], untilWrap);
+    function(values, nrOfSamples - untilWrap);
+  };
+
+  template <typename Value>
+  [[nodiscard]] SlotStatistics statistics(const size_t slotIndex,
+                                          const uint32_t nrOfSamples) const {
+    SlotStatistics result;
+    result.min = INT32_MAX;
+    result.max = INT32_MIN;
+    forEachSegment(slotIndex, nrOfSamples,
+                   [&result](const uint8_t *values, const size_t size) {
+                     for (size_t i = 0; i < size; ++i) {
+                       const auto value = static_cast<Value>(
+                           values[2 * i] | values[2 * i + 1] << 8);
+                       result.min = value < result.min ? value : result.min;
+                       result.max = value > result.max ? value : result.max;
+                       result.sum += value;
+                     }
+                     result.count += size;
+                   });
+    if (result.count == 0) {
+      return {};
+    }
+    return result;
+  };
+
+private:
+  // position of the next sample in the columns
+  uint32_t mHead = 0;
+  uint32_t mCount = 0;
+  uint32_t mCapacity = 0; // samples per column
+  uint32_t mReadOutStart = 0;
+  uint32_t mReadOutCount = 0;
+  // index in the read out range of the next sample to read
+  uint32_t mReadOutNext = 0;
+  // bytes of the sample mReadOutNext that are already read out
+  size_t mReadOutByteOffset = 0;
+  bool mReadOutPinned = false;
+  bool mReadOutInvalidated = false;
+  SampleOverflowBuffer<OVERFLOW_BUFFER_SIZE> mOverflow;
+
+  size_t mSampleSizeBytes = 0;
+};
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* COLUMNAR_SAMPLE_HISTORY_H */
@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef COMPRESSED_SAMPLE_HISTORY_H
+#define COMPRESSED_SAMPLE_HISTORY_H
+
+#include "ByteArray.h"
+#include "Sample.h"
+#include "SampleHistoryRingBuffer.h"
+#include "SampleOverflowBuffer.h"
+
+#include <cstring>
+
+namespace sensirion::upt::ble_server {
+
+#ifndef BLE_SERVER_COMPRESSED_HISTORY_KEYFRAME_INTERVAL
+#define BLE_SERVER_COMPRESSED_HISTORY_KEYFRAME_INTERVAL 32
+#endif
+
+// Logs Samples over time to be downloaded, like SampleHistoryRingBuffer, but
+// stores them compressed. Samples are grouped into blocks, each starting with
+// an uncompressed keyframe followed by the difference of every 16-bit slot to
+// the previous sample, zigzag and varint encoded. Slowly changing signals
+// need a single byte per slot. When the buffer is full, the oldest block is
+// dropped. Samples are decompressed while they are read out. Like in
+// SampleHistoryRingBuffer, the read out range is pinned until endReadOut.
+//
+// Block layout: [length (2 bytes)] [sample count (1 byte)] [keyframe] [deltas]
+template <size_t BUFFER_SIZE = SAMPLE_HISTORY_RING_BUFFER_SIZE_BYTES,
+          size_t OVERFLOW_BUFFER_SIZE = SAMPLE_OVERFLOW_BUFFER_SIZE_BYTES>
+class CompressedSampleHistory : protected ByteArray<BUFFER_SIZE> {
+  static constexpr size_t KEYFRAME_INTERVAL =
+      BLE_SERVER_COMPRESSED_HISTORY_KEYFRAME_INTERVAL;
+  static constexpr size_t BLOCK_HEADER_SIZE_BYTES = 3;
+  // a varint holds 7 bits per byte
+  static constexpr size_t MAX_DELTA_SIZE_BYTES = 3;
+  static constexpr size_t MAX_SLOTS = (MAX_SAMPLE_SIZE_BYTES + 1) / 2;
+
+  static_assert(KEYFRAME_INTERVAL > 0 && KEYFRAME_INTERVAL <= UINT8_MAX,
+                "keyframe interval must fit the block sample count");
+  static_assert(BUFFER_SIZE >=
+                    BLOCK_HEADER_SIZE_BYTES + MAX_SAMPLE_SIZE_BYTES +
+                        (KEYFRAME_INTERVAL - 1) * MAX_SLOTS *
+                            MAX_DELTA_SIZE_BYTES,
+                "buffer must hold at least one block");
+
+public:
+  void putSample(const Sample &sample) {
+    if (mSampleSizeBytes == 0) {
+      return;
+    }
+    uint8_t deltas[MAX_SLOTS * MAX_DELTA_SIZE_BYTES];
+    bool startBlock =
+        !mHasOpenBlock || blockSampleCount(mOpenBlock) >= KEYFRAME_INTERVAL;
+    size_t deltasSize = startBlock ? 0 : encodeDeltas(sample, deltas);
+    size_t requiredBytes =
+        startBlock ? BLOCK_HEADER_SIZE_BYTES + mSampleSizeBytes : deltasSize;
+
+    // once samples are held back, later ones queue behind them to keep the
+    // order of the history
+    if (mReadOutPinned &&
+        (!mOverflow.isEmpty() || wouldDropPinnedSamples(requiredBytes))) {
+      if (mOverflow.put(sample.getDataArray().data())) {
+        return;
+      }
+      // the overflow buffer is full too, give up the pinned range
+      mReadOutInvalidated = true;
+      endReadOut();
+      putSample(sample);
+      return;
+    }
+
+    while (BUFFER_SIZE - mUsedBytes < requiredBytes) {
+      if (mHasOpenBlock && mTail == mOpenBlock) {
+        // the open block is the only one left, replace it by a new one
+        startBlock = true;
+        deltasSize = 0;
+        requiredBytes = BLOCK_HEADER_SIZE_BYTES + mSampleSizeBytes;
+      }
+      dropOldestBlock();
+    }
+
+    size_t position = wrap(mTail + mUsedBytes);
+    if (startBlock) {
+      mOpenBlock = position;
+      mHasOpenBlock = true;
+      writeBlockHeader(mOpenBlock, requiredBytes, 1);
+      position = wrap(position + BLOCK_HEADER_SIZE_BYTES);
+      for (size_t i = 0; i < mSampleSizeBytes; ++i) {
+        this->mData[position] = sample.getByte(i);
+        position = wrap(position + 1);
+      }
+    } else {
+      for (size_t i = 0; i < deltasSize; ++i) {
+        this->mData[position] = deltas[i];
+        position = wrap(position + 1);
+      }
+      writeBlockHeader(mOpenBlock, blockLength(mOpenBlock) + deltasSize,
+                       blockSampleCount(mOpenBlock) + 1);
+    }
+    mUsedBytes += requiredBytes;
+    memcpy(mLatestSample, sample.getDataArray().data(), mSampleSizeBytes);
+    ++mSampleCount;
+  };
+
+  bool setSampleSize(const size_t sampleSize) {
+    mSampleSizeBytes = sampleSize;
+    mOverflow.setSampleSize(sampleSize);
+    reset();
+    return true;
+  };
+
+  [[nodiscard]] uint32_t numberOfSamplesInHistory() const {
+    return mSampleCount;
+  };
+
+  void startReadOut(const uint32_t nrOfSamples) {
+    mReadOutPinned = true;
+    mReadOutInvalidated = false;
+    mReadOutEndNumber = endSampleNumber();
+    mReadOutStartNumber = mFirstSampleNumber;
+    if (nrOfSamples < mSampleCount) {
+      mReadOutStartNumber += mSampleCount - nrOfSamples;
+    }
+    positionReadOut(mReadOutStartNumber);
+  };
+
+  // Releases the pinned range and adds the samples held back meanwhile
+  void endReadOut() {
+    mReadOutPinned = false;
+    while (!mOverflow.isEmpty()) {
+      Sample sample;
+      sample.setData(mOverflow.front(), mSampleSizeBytes);
+      mOverflow.pop();
+      putSample(sample);
+    }
+  };
+
+  // True if the pinned range had to be dropped since startReadOut
+  [[nodiscard]] bool readOutInvalidated() const {
+    return mReadOutInvalidated;
+  };
+
+  // Moves the read out to the given byte offset from the start of the range
+  // given to startReadOut, e.g. to send parts of a download again
+  void seekReadOut(const size_t byteOffset) {
+    if (mSampleSizeBytes == 0) {
+      return;
+    }
+    uint32_t sampleNumber = mReadOutStartNumber + byteOffset / mSampleSizeBytes;
+    if (sampleNumber < mFirstSampleNumber) {
+      // already dropped, continue with the oldest sample
+      sampleNumber = mFirstSampleNumber;
+    }
+    positionReadOut(sampleNumber);
+    if (byteOffset % mSampleSizeBytes != 0 &&
+        sampleNumber < readOutEndNumber()) {
+      decodeNextSample();
+      mReadOutSampleOffset = byteOffset % mSampleSizeBytes;
+    }
+  };
+
+  // Number of samples left until the read out reaches the end of its range
+  [[nodiscard]] uint32_t numberOfSamplesToReadOut() const {
+    const uint32_t partialSample =
+        mReadOutSampleOffset < mSampleSizeBytes ? 1 : 0;
+    return readOutEndNumber() - mReadOutNextNumber + partialSample;
+  };
+
+  // Decompresses up to maxBytes of the read out range into destination. The
+  // range is treated as a continuous byte stream that may be split within a
+  // sample.
+  size_t readOutNextBytes(uint8_t *destination, const size_t maxBytes) {
+    size_t copiedBytes = 0;
+    while (copiedBytes < maxBytes) {
+      if (mReadOutSampleOffset == mSampleSizeBytes) {
+        if (mReadOutNextNumber >= readOutEndNumber()) {
+          break;
+        }
+        decodeNextSample();
+      }
+      size_t count = mSampleSizeBytes - mReadOutSampleOffset;
+      if (count > maxBytes - copiedBytes) {
+        count = maxBytes - copiedBytes;
+      }
+      memcpy(&destination[copiedBytes], &mReadOutSample[mReadOutSampleOffset],
+             count);
+      mReadOutSampleOffset += count;
+      copiedBytes += count;
+    }
+    return copiedBytes;
+  };
+
+  // Decompresses up to maxSamples samples into destination
+  size_t readOutNextSamples(uint8_t *destination, const size_t maxSamples) {
+    if (mSampleSizeBytes == 0) {
+      return 0;
+    }
+    return readOutNextBytes(destination, maxSamples * mSampleSizeBytes) /
+           mSampleSizeBytes;
+  };
+
+  void reset() {
+    mTail = 0;
+    mUsedBytes = 0;
+    mOpenBlock = 0;
+    mHasOpenBlock = false;
+    mSampleCount = 0;
+    mFirstSampleNumber = 0;
+    mReadOutStartNumber = 0;
+    mReadOutEndNumber = 0;
+    mReadOutPinned = false;
+    mReadOutInvalidated = false;
+    mOverflow.reset();
+    positionReadOut(0);
+  };
+
+private:
+  [[nodiscard]] static size_t wrap(const size_t position) {
+    return position < BUFFER_SIZE ? position : position - BUFFER_SIZE;
+  };
+
+  [[nodiscard]] uint32_t endSampleNumber() const {
+    return mFirstSampleNumber + mSampleCount;
+  };
+
+  // The read out range ends with the latest sample unless it is pinned
+  [[nodiscard]] uint32_t readOutEndNumber() const {
+    return mReadOutPinned ? mReadOutEndNumber : endSampleNumber();
+  };
+
+  // True if freeing requiredBytes drops a block with samples of the pinned
+  // read out range
+  [[nodiscard]] bool wouldDropPinnedSamples(const size_t requiredBytes) const {
+    size_t freeBytes = BUFFER_SIZE - mUsedBytes;
+    size_t block = mTail;
+    uint32_t blockFirstNumber = mFirstSampleNumber;
+    while (freeBytes < requiredBytes &&
+           blockFirstNumber < endSampleNumber()) {
+      const size_t sampleCount = blockSampleCount(block);
+      if (blockFirstNumber < mReadOutEndNumber &&
+          blockFirstNumber + sampleCount > mReadOutStartNumber) {
+        return true;
+      }
+      freeBytes += blockLength(block);
+      blockFirstNumber += sampleCount;
+      block = wrap(block + blockLength(block));
+    }
+    return false;
+  };
+
+  [[nodiscard]] size_t blockLength(const size_t block) const {
+    return this->mData[block] | (this->mData[wrap(block + 1)] << 8);
+  };
+
+  [[nodiscard]] size_t blockSampleCount(const size_t block) const {
+    return this->mData[wrap(block + 2)];
+  };
+
+  void writeBlockHeader(const size_t block, const size_t length,
+                        const size_t sampleCount) {
+    this->mData[block] = static_cast<uint8_t>(length);
+    this->mData[wrap(block + 1)] = static_cast<uint8_t>(length >> 8);
+    this->mData[wrap(block + 2)] = static_cast<uint8_t>(sampleCount);
+  };
+
+  void dropOldestBlock() {
+    const size_t length = blockLength(mTail);
+    const size_t sampleCount = blockSampleCount(mTail);
+    if (mHasOpenBlock && mTail == mOpenBlock) {
+      mHasOpenBlock = false;
+    }
+    mTail = wrap(mTail + length);
+    mUsedBytes -= length;
+    mSampleCount -= sampleCount;
+    mFirstSampleNumber += sampleCount;
+  };
+
+  // Slots are 16 bits little endian, an odd trailing byte is its own slot
+  [[nodiscard]] static uint16_t readSlot(const uint8_t *sample,
+                                         const size_t sampleSize,
+                                         const size_t slot) {
+    const size_t position = 2 * slot;
+    const uint16_t high = position + 1 < sampleSize ? sample[position + 1] : 0;
+    return sample[position] | (high << 8);
+  };
+
+  static void writeSlot(uint8_t *sample, const size_t sampleSize,
+                        const size_t slot, const uint16_t value) {
+    const size_t position = 2 * slot;
+    sample[position] = static_cast<uint8_t>(value);
+    if (position + 1 < sampleSize) {
+      sample[position + 1] = static_cast<uint8_t>(value >> 8);
+    }
+  };
+
+  [[nodiscard]] size_t numberOfSlots() const {
+    return (mSampleSizeBytes + 1) / 2;
+  };
+
+  size_t encodeDeltas(const Sample &sample, uint8_t *deltas) const {
+    size_t size = 0;
+    for (size_t slot = 0; slot < numberOfSlots(); ++slot) {
+      const auto delta = static_cast<int16_t>(
+          readSlot(sample.getDataArray().data(), mSampleSizeBytes, slot) -
+          readSlot(mLatestSample, mSampleSizeBytes, slot));
+      // zigzag encoding maps small negative deltas to small numbers
+      auto value = static_cast<uint16_t>((static_cast<uint16_t>(delta) << 1) ^
+                                         static_cast<uint16_t>(delta >> 15));
+      while (value >= 0x80) {
+        deltas[size++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+      }
+      deltas[size++] = static_cast<uint8_t>(value);
+    }
+    return size;
+  };
+
+  // Sets the read out so that the next decoded sample has the given number
+  void positionReadOut(const uint32_t sampleNumber) {
+    uint32_t blockFirstNumber = mFirstSampleNumber;
+    mReadOutBlock = mTail;
+    while (mReadOutBlock != mOpenBlock &&
+           blockFirstNumber + blockSampleCount(mReadOutBlock) <= sampleNumber &&
+           blockFirstNumber < endSampleNumber()) {
+      blockFirstNumber += blockSampleCount(mReadOutBlock);
+      mReadOutBlock = wrap(mReadOutBlock + blockLength(mReadOutBlock));
+    }
+    mReadOutIndexInBlock = 0;
+    mReadOutPosition = wrap(mReadOutBlock + BLOCK_HEADER_SIZE_BYTES);
+    mReadOutNextNumber = blockFirstNumber;
+    while (mReadOutNextNumber < sampleNumber &&
+           mReadOutNextNumber < endSampleNumber()) {
+      decodeNextSample();
+    }
+    mReadOutSampleOffset = mSampleSizeBytes;
+  };
+
+  void decodeNextSample() {
+    if (mReadOutIndexInBlock >= blockSampleCount(mReadOutBlock)) {
+      mReadOutBlock = wrap(mReadOutBlock + blockLength(mReadOutBlock));
+      mReadOutIndexInBlock = 0;
+      mReadOutPosition = wrap(mReadOutBlock + BLOCK_HEADER_SIZE_BYTES);
+    }
+    if (mReadOutIndexInBlock == 0) {
+      for (size_t i = 0; i < mSampleSizeBytes; ++i) {
+        mReadOutSample[i] = this->mData[mReadOutPosition];
+        mReadOutPosition = wrap(mReadOutPosition + 1);
+      }
+    } else {
+      for (size_t slot = 0; slot < numberOfSlots(); ++slot) {
+        uint16_t value = 0;
+        for (size_t i = 0; i < MAX_DELTA_SIZE_BYTES; ++i) {
+          const uint8_t byte = this->mData[mReadOutPosition];
+          mReadOutPosition = wrap(mReadOutPosition + 1);
+          value |= (byte & 0x7F) << (7 * i);
+          if ((byte & 0x80) == 0) {
+            break;
+          }
+        }
+        const auto delta = static_cast<int16_t>((value >> 1) ^ -(value & 1));
+        writeSlot(mReadOutSample, mSampleSizeBytes, slot,
+                  readSlot(mReadOutSample, mSampleSizeBytes, slot) + delta);
+      }
+    }
+    ++mReadOutIndexInBlock;
+    ++mReadOutNextNumber;
+    mReadOutSampleOffset = 0;
+  };
+
+private:
+  size_t mTail = 0; // header of the oldest block
+  size_t mUsedBytes = 0;
+  size_t mOpenBlock = 0; // header of the block new samples are added to
+  bool mHasOpenBlock = false;
+  uint8_t mLatestSample[MAX_SAMPLE_SIZE_BYTES] = {};
+
+  // samples are numbered continuously to keep track of dropped blocks
+  uint32_t mSampleCount = 0;
+  uint32_t mFirstSampleNumber = 0;
+
+  uint32_t mReadOutStartNumber = 0;
+  uint32_t mReadOutEndNumber = 0;
+  bool mReadOutPinned = false;
+  bool mReadOutInvalidated = false;
+  SampleOverflowBuffer<OVERFLOW_BUFFER_SIZE> mOverflow;
+  uint32_t mReadOutNextNumber = 0; // number of the next sample to decode
+  size_t mReadOutBlock = 0;
+  size_t mReadOutIndexInBlock = 0;
+  size_t mReadOutPosition = 0; // encoded data of the next sample to decode
+  uint8_t mReadOutSample[MAX_SAMPLE_SIZE_BYTES] = {}; // latest decoded sample
+  size_t mReadOutSampleOffset = 0; // bytes of mReadOutSample already read out
+
+  size_t mSampleSizeBytes = 0;
+};
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* COMPRESSED_SAMPLE_HISTORY_H */
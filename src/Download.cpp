@@ -15,23 +15,23 @@ void DownloadHeader::setAgeOfLatestSampleMilliSeconds(const uint32_t age) {
 void DownloadHeader::setDownloadSampleCount(const uint16_t count) {
   write16BitLittleEndian(count, 14);
 }
-
-// DownloadPacket
-void DownloadPacket::setDownloadSequenceNumber(const uint16_t number) {
-  write16BitLittleEndian(number, 0);
+void DownloadHeader::setDownloadFlags(const uint8_t flags) {
+  writeByte(flags, 16);
+}
+void DownloadHeader::setPacketSizeBytes(const uint8_t size) {
+  writeByte(size, 17);
+}
+void DownloadHeader::setSlotMask(const uint16_t mask) {
+  write16BitLittleEndian(mask, 18);
 }
 
-void DownloadPacket::writeSample(const Sample &sample, const size_t sampleSize,
-                                 const size_t position) {
-  for (int i = 0; i < sampleSize; ++i) {
-    writeSampleByte(sample.getByte(i), position * sampleSize + i);
-  }
+// DownloadPacket
+DownloadPacket::DownloadPacket(const size_t size) : mSize(size) {
+  assert(size <= MAX_DOWNLOAD_PACKET_SIZE_BYTES);
 }
 
-void DownloadPacket::writeSampleByte(const uint8_t byte,
-                                     const size_t positionInSampleData) {
-  // shift to after downloadSequenceNumber
-  writeByte(byte, 2 + positionInSampleData);
+void DownloadPacket::setDownloadSequenceNumber(const uint16_t number) {
+  write16BitLittleEndian(number, 0);
 }
 
 } // namespace sensirion::upt::ble_server
\ No newline at end of file
@@ -36,7 +36,32 @@
 
 namespace sensirion::upt::ble_server {
 
+// fits the default ATT MTU of 23 bytes
 static constexpr size_t DOWNLOAD_PACKET_SIZE_BYTES = 20;
+// fits a single link layer PDU with data length extension (251 bytes)
+static constexpr size_t MAX_DOWNLOAD_PACKET_SIZE_BYTES = 244;
+// the download sequence number precedes the sample data in each packet
+static constexpr size_t DOWNLOAD_PACKET_HEADER_SIZE_BYTES = 2;
+static constexpr size_t DOWNLOAD_PACKET_PAYLOAD_SIZE_BYTES =
+    DOWNLOAD_PACKET_SIZE_BYTES - DOWNLOAD_PACKET_HEADER_SIZE_BYTES;
+
+// Flags announced in the download header
+// Samples are sent as a continuous byte stream and may span two packets
+static constexpr uint8_t DOWNLOAD_FLAG_PACKED_SAMPLES = 1 << 0;
+// The client has to acknowledge received packets on the download ack
+// characteristic
+static constexpr uint8_t DOWNLOAD_FLAG_ACKNOWLEDGED = 1 << 1;
+// Bits 2 and 3 hold the history tier, tiers above 0 send records of min, mean
+// and max samples
+static constexpr uint8_t DOWNLOAD_FLAG_TIER_SHIFT = 2;
+static constexpr uint8_t DOWNLOAD_FLAG_TIER_MASK = 0x3 << 2;
+// Only the 16 bit slots of the slot mask in the header are sent, records are
+// made of these slots in order
+static constexpr uint8_t DOWNLOAD_FLAG_SELECTED_SLOTS = 1 << 4;
+// The running download was ended before all announced samples were sent,
+// because they were overwritten or the history interval changed. Sent in a
+// header with a sample count of 0, no packets of the download follow.
+static constexpr uint8_t DOWNLOAD_FLAG_ABORTED = 1 << 5;
 
 class DownloadHeader : public ByteArray<DOWNLOAD_PACKET_SIZE_BYTES> {
 public:
@@ -47,18 +72,38 @@ public:
   void setAgeOfLatestSampleMilliSeconds(uint32_t age);
 
   void setDownloadSampleCount(uint16_t count);
+
+  void setDownloadFlags(uint8_t flags);
+
+  void setPacketSizeBytes(uint8_t size);
+
+  void setSlotMask(uint16_t mask);
 };
 
-class DownloadPacket : public ByteArray<DOWNLOAD_PACKET_SIZE_BYTES> {
+// Packet of up to MAX_DOWNLOAD_PACKET_SIZE_BYTES, only the first size() bytes
+// are sent
+class DownloadPacket : public ByteArray<MAX_DOWNLOAD_PACKET_SIZE_BYTES> {
 public:
+  explicit DownloadPacket(size_t size = DOWNLOAD_PACKET_SIZE_BYTES);
+
+  [[nodiscard]] size_t size() const { return mSize; }
+
   void setDownloadSequenceNumber(uint16_t number);
 
-  void writeSample(const Sample &sample, size_t sampleSize, size_t position);
+  // Sample data section of the packet, e.g. to read samples into it directly
+  uint8_t *sampleData() { return &mData[DOWNLOAD_PACKET_HEADER_SIZE_BYTES]; }
 
-  void writeSampleByte(uint8_t byte, size_t positionInSampleData);
+private:
+  size_t mSize;
 };
 
-enum DownloadState { INACTIVE = 0, START = 1, DOWNLOADING = 2, COMPLETED = 3 };
+enum DownloadState {
+  INACTIVE = 0,
+  START = 1,
+  DOWNLOADING = 2,
+  COMPLETED = 3,
+  ABORTED = 4 // the aborting header is still to be sent
+};
 
 } // namespace sensirion::upt::ble_server
 
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FIXED_SAMPLE_HISTORY_RING_BUFFER_H
+#define FIXED_SAMPLE_HISTORY_RING_BUFFER_H
+
+#include "ByteArray.h"
+#include "Sample.h"
+#include "SampleOverflowBuffer.h"
+
+#include <cstring>
+
+namespace sensirion::upt::ble_server {
+
+// Largest power of two number of samples fitting into bufferSize bytes
+constexpr size_t fixedHistoryCapacity(const size_t bufferSize,
+                                      const size_t sampleSize) {
+  size_t capacity = 1;
+  while (capacity * 2 * sampleSize <= bufferSize) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+// SampleHistoryRingBuffer for a sample size known at compile time. The
+// capacity is a power of two, so the ring indices are masked free running
+// sample numbers and all strides are constants. Only samples of SAMPLE_SIZE
+// bytes are stored; setSampleSize returns false for a different size and
+// the history stays empty then.
+template <size_t SAMPLE_SIZE, size_t CAPACITY,
+          size_t OVERFLOW_BUFFER_SIZE = SAMPLE_OVERFLOW_BUFFER_SIZE_BYTES>
+class FixedSampleHistoryRingBuffer
+    : protected ByteArray<SAMPLE_SIZE * CAPACITY> {
+  static_assert(SAMPLE_SIZE > 0 && SAMPLE_SIZE <= MAX_SAMPLE_SIZE_BYTES,
+                "sample size must fit a Sample");
+  static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0,
+                "capacity must be a power of two");
+  static constexpr uint32_t INDEX_MASK = CAPACITY - 1;
+  static constexpr size_t BUFFER_SIZE = SAMPLE_SIZE * CAPACITY;
+
+public:
+  void putSample(const Sample &sample) {
+    putRecord(sample.getDataArray().data());
+  };
+
+  void putRecord(const uint8_t *record) {
+    if (!mSampleSizeMatches) {
+      return;
+    }
+    if (mReadOutPinned && numberOfSamplesInHistory() == CAPACITY &&
+        mTail == mReadOutStart && mReadOutStart != mReadOutEnd) {
+      if (mOverflow.put(record)) {
+        return;
+      }
+      // the overflow buffer is full too, give up the pinned range
+      mReadOutInvalidated = true;
+      endReadOut();
+    }
+    memcpy(&this->mData[(mHead & INDEX_MASK) * SAMPLE_SIZE], record,
+           SAMPLE_SIZE);
+    ++mHead;
+    if (mHead - mTail > CAPACITY) {
+      ++mTail;
+    }
+  };
+
+  bool setSampleSize(const size_t sampleSize) {
+    mSampleSizeMatches = (sampleSize == SAMPLE_SIZE);
+    mOverflow.setSampleSize(SAMPLE_SIZE);
+    reset();
+    return mSampleSizeMatches;
+  };
+
+  [[nodiscard]] uint32_t numberOfSamplesInHistory() const {
+    return mHead - mTail;
+  };
+
+  void startReadOut(const uint32_t nrOfSamples) {
+    mReadOutPinned = true;
+    mReadOutInvalidated = false;
+    mReadOutEnd = mHead;
+    mReadOutStart =
+        nrOfSamples >= numberOfSamplesInHistory() ? mTail : mHead - nrOfSamples;
+    mReadOutNext = mReadOutStart;
+    mReadOutByteOffset = 0;
+  };
+
+  // Releases the pinned range and adds the samples held back meanwhile
+  void endReadOut() {
+    mReadOutPinned = false;
+    while (!mOverflow.isEmpty()) {
+      putRecord(mOverflow.front());
+      mOverflow.pop();
+    }
+  };
+
+  // True if the pinned range had to be overwritten since startReadOut
+  [[nodiscard]] bool readOutInvalidated() const {
+    return mReadOutInvalidated;
+  };
+
+  // Moves the read out to the given byte offset from the start of the range
+  // given to startReadOut, e.g. to send parts of a download again
+  void seekReadOut(const size_t byteOffset) {
+    mReadOutNext = mReadOutStart + byteOffset / SAMPLE_SIZE;
+    mReadOutByteOffset = byteOffset % SAMPLE_SIZE;
+  };
+
+  // Number of samples left until the read out reaches the end of its range
+  [[nodiscard]] uint32_t numberOfSamplesToReadOut() const {
+    return readOutEnd() - mReadOutNext;
+  };
+
+  // Copies up to maxBytes of the read out range to destination
+  size_t readOutNextBytes(uint8_t *destination, const size_t maxBytes) {
+    size_t count =
+        numberOfSamplesToReadOut() * SAMPLE_SIZE - mReadOutByteOffset;
+    if (count > maxBytes) {
+      count = maxBytes;
+    }
+    if (count == 0) {
+      return 0;
+    }
+    const size_t startByte =
+        (mReadOutNext & INDEX_MASK) * SAMPLE_SIZE + mReadOutByteOffset;
+    const size_t bytesUntilWrap = BUFFER_SIZE - startByte;
+    const size_t firstCount = count < bytesUntilWrap ? count : bytesUntilWrap;
+    memcpy(destination, &this->mData[startByte], firstCount);
+    memcpy(&destination[firstCount], this->mData.data(), count - firstCount);
+
+    const size_t consumedBytes = mReadOutByteOffset + count;
+    mReadOutNext += consumedBytes / SAMPLE_SIZE;
+    mReadOutByteOffset = consumedBytes % SAMPLE_SIZE;
+    return count;
+  };
+
+  // Copies up to maxSamples samples of the read out range to destination
+  size_t readOutNextSamples(uint8_t *destination, const size_t maxSamples) {
+    return readOutNextBytes(destination, maxSamples * SAMPLE_SIZE) /
+           SAMPLE_SIZE;
+  };
+
+  void reset() {
+    mHead = 0;
+    mTail = 0;
+    mReadOutStart = 0;
+    mReadOutEnd = 0;
+    mReadOutNext = 0;
+    mReadOutByteOffset = 0;
+    mReadOutPinned = false;
+    mReadOutInvalidated = false;
+    mOverflow.reset();
+  };
+
+private:
+  // The read out range ends with the latest sample unless it is pinned
+  [[nodiscard]] uint32_t readOutEnd() const {
+    return mReadOutPinned ? mReadOutEnd : mHead;
+  };
+
+private:
+  // free running sample numbers, masked to get the position in the buffer
+  uint32_t mHead = 0;
+  uint32_t mTail = 0;
+  uint32_t mReadOutStart = 0;
+  uint32_t mReadOutEnd = 0;
+  uint32_t mReadOutNext = 0;
+  // bytes of the sample mReadOutNext that are already read out
+  size_t mReadOutByteOffset = 0;
+  bool mReadOutPinned = false;
+  bool mReadOutInvalidated = false;
+  bool mSampleSizeMatches = false;
+  SampleOverflowBuffer<OVERFLOW_BUFFER_SIZE> mOverflow;
+};
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* FIXED_SAMPLE_HISTORY_RING_BUFFER_H */
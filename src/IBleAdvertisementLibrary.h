@@ -31,6 +31,8 @@
 
 #ifndef I_BLE_ADVERTISEMENT_LIBRARY_H
 #define I_BLE_ADVERTISEMENT_LIBRARY_H
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 namespace sensirion::upt::ble_server {
@@ -48,6 +50,19 @@ public:
    */
   virtual void setAdvertisingData(const std::string &data) = 0;
 
+  /**
+   * @brief Replace the payload given to setAdvertisingData without
+   *        restarting advertising.
+   * @param data Raw advertisement payload of the same size as the one given
+   *        to setAdvertisingData.
+   * @param size Number of bytes in data.
+   * @return true if the running advertisement was updated, false if not
+   *         supported, then stop, set and start advertising instead.
+   */
+  virtual bool updateAdvertisingData(const uint8_t *data, size_t size) {
+    return false;
+  };
+
   /**
    * @brief Start advertising.
    */
@@ -66,6 +66,30 @@ public:
    *        (e.g. `UptBleServer`).
    */
   virtual void setProviderCallbacks(IProviderCallbacks *providerCallbacks) = 0;
+
+  /**
+   * @brief Set the PHY requested from every central on connect.
+   *
+   * The central may keep a slower PHY, the one in use is reported through
+   * IProviderCallbacks::onLinkUpdate.
+   *
+   * @param phy PHY to request, LE_1M to not request a change
+   * @return true if successful, false if the chip does not support the PHY,
+   *         always for LE_CODED
+   */
+  virtual bool setPreferredPhy(LinkPhy phy) = 0;
+
+  /**
+   * @brief Set the link-layer data length requested on connect.
+   *
+   * Larger link-layer packets avoid splitting download packets larger than
+   * 27 bytes into several link-layer packets.
+   *
+   * @param octets payload bytes per link-layer packet, 27 to 251, 0 to not
+   *        request a change
+   * @return true if successful, else false
+   */
+  virtual bool setPreferredDataLength(uint16_t octets) = 0;
 };
 
 } // namespace sensirion::upt::ble_server
@@ -41,9 +41,19 @@ namespace sensirion::upt::ble_server {
 enum class Permission : uint8_t {
   READ_PERMISSION = 1 << 0,
   WRITE_PERMISSION = 1 << 1,
-  NOTIFY_PERMISSION = 1 << 2
+  NOTIFY_PERMISSION = 1 << 2,
+  WRITE_NO_RESPONSE_PERMISSION = 1 << 3
 };
 
+/**
+ * @brief How a characteristic value is pushed to subscribed centrals.
+ *
+ * Indications are confirmed by the central before the next one can be sent,
+ * notifications are not confirmed and allow several packets per connection
+ * interval.
+ */
+enum class TransmitMode : uint8_t { INDICATE, NOTIFY };
+
 inline Permission operator|(Permission a, Permission b) {
   return static_cast<Permission>(static_cast<uint8_t>(a) |
                                  static_cast<uint8_t>(b));
@@ -65,6 +75,70 @@ inline bool operator==(Permission a, Permission b) {
  */
 using ble_service_callback_t = std::function<void(std::string)>;
 
+/**
+ * @brief Opaque handle of a characteristic, resolved once from its UUID to
+ *        avoid UUID lookups on frequent calls.
+ */
+using CharacteristicHandle = uint16_t;
+
+static constexpr CharacteristicHandle INVALID_CHARACTERISTIC_HANDLE = 0xFFFF;
+
+/**
+ * @brief Handle of the connection to a central.
+ */
+using ConnectionHandle = uint16_t;
+
+static constexpr ConnectionHandle INVALID_CONNECTION_HANDLE = 0xFFFF;
+
+/**
+ * @brief Physical layer of a connection.
+ *
+ * LE_2M doubles the bit rate of LE_1M, LE_CODED trades bit rate for range.
+ */
+enum class LinkPhy : uint8_t { LE_1M = 1, LE_2M = 2, LE_CODED = 3 };
+
+/**
+ * @brief Negotiated properties of the link to a central.
+ */
+struct LinkInfo {
+  uint16_t mtu = 23;
+  LinkPhy txPhy = LinkPhy::LE_1M;
+  LinkPhy rxPhy = LinkPhy::LE_1M;
+};
+
+/**
+ * @brief Parameters of a connection to a central.
+ *
+ * Short intervals transfer data faster, long intervals and a peripheral
+ * latency let the radio sleep while idle. The supervision timeout has to
+ * exceed (1 + latency) * maxIntervalMs * 2.
+ */
+struct ConnectionParameters {
+  float minIntervalMs = 7.5f;
+  float maxIntervalMs = 15.0f;
+  uint16_t latency = 0; // connection events the peripheral may skip
+  uint16_t supervisionTimeoutMs = 2000;
+};
+
+/**
+ * @brief Non-owning view on a written characteristic value.
+ *
+ * Only valid during the callback it is passed to.
+ */
+struct ByteView {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+
+  uint8_t operator[](const size_t index) const { return data[index]; }
+};
+
+/**
+ * @brief Callback type invoked with the connection that wrote the value of a
+ *        characteristic and the written value, without copying it.
+ */
+using ble_characteristic_write_callback_t =
+    std::function<void(ConnectionHandle, ByteView)>;
+
 class IBleServiceLibrary {
 public:
   virtual ~IBleServiceLibrary() = default;
@@ -104,6 +178,24 @@ public:
   virtual bool characteristicSetValue(const char *uuid, const uint8_t *data,
                                       size_t size) = 0;
 
+  /**
+   * @brief Get the handle of a created characteristic.
+   * @param uuid Characteristic UUID.
+   * @return The handle, or INVALID_CHARACTERISTIC_HANDLE if no characteristic
+   *         with this UUID was created.
+   */
+  virtual CharacteristicHandle getCharacteristicHandle(const char *uuid) = 0;
+
+  /**
+   * @brief Set a characteristic value from a byte buffer.
+   * @param handle Characteristic handle from getCharacteristicHandle.
+   * @param data Pointer to data buffer.
+   * @param size Number of bytes in buffer.
+   * @return true on success, false otherwise.
+   */
+  virtual bool characteristicSetValue(CharacteristicHandle handle,
+                                      const uint8_t *data, size_t size) = 0;
+
   /**
    * @brief Set a characteristic value from an integer.
    */
@@ -127,12 +219,45 @@ public:
   virtual std::string characteristicGetValue(const char *uuid) = 0;
 
   /**
-   * @brief Send a GATT notification for a characteristic.
+   * @brief Send a GATT indication for a characteristic.
    * @param uuid Characteristic UUID.
-   * @return true if notification was queued/sent.
+   * @return true if the indication was queued/sent.
    */
   virtual bool characteristicNotify(const char *uuid) = 0;
 
+  /**
+   * @brief Push the characteristic value to subscribed centrals.
+   * @param uuid Characteristic UUID.
+   * @param mode Send as indication or notification.
+   * @return true if the value was queued/sent, false e.g. if the transmit
+   *         queue of the stack is full.
+   */
+  virtual bool characteristicNotify(const char *uuid, TransmitMode mode) = 0;
+
+  /**
+   * @brief Push the characteristic value to subscribed centrals.
+   * @param handle Characteristic handle from getCharacteristicHandle.
+   * @param mode Send as indication or notification.
+   * @return true if the value was queued/sent.
+   */
+  virtual bool characteristicNotify(CharacteristicHandle handle,
+                                    TransmitMode mode) = 0;
+
+  /**
+   * @brief Send a value to a single subscribed central without changing the
+   *        characteristic value seen by the others.
+   * @param handle Characteristic handle from getCharacteristicHandle.
+   * @param data Pointer to data buffer.
+   * @param size Number of bytes in buffer.
+   * @param connection Connection of the central.
+   * @param mode Send as indication or notification.
+   * @return true if the value was queued/sent.
+   */
+  virtual bool characteristicNotify(CharacteristicHandle handle,
+                                    const uint8_t *data, size_t size,
+                                    ConnectionHandle connection,
+                                    TransmitMode mode) = 0;
+
   /**
    * @brief Register a callback invoked on characteristic writes/updates.
    * @param uuid Characteristic UUID.
@@ -142,12 +267,62 @@ public:
   registerCharacteristicCallback(const char *uuid,
                                  const ble_service_callback_t &callback) = 0;
 
+  /**
+   * @brief Register a callback invoked on characteristic writes with a view
+   *        on the written value, also before the characteristic is created.
+   * @param uuid Characteristic UUID.
+   * @param callback Function to call with the new value.
+   */
+  virtual void registerCharacteristicCallback(
+      const char *uuid,
+      const ble_characteristic_write_callback_t &callback) = 0;
+
+  /**
+   * @brief Register a callback invoked on characteristic writes with a view
+   *        on the written value.
+   * @param handle Characteristic handle from getCharacteristicHandle.
+   * @param callback Function to call with the new value.
+   */
+  virtual void registerCharacteristicCallback(
+      CharacteristicHandle handle,
+      const ble_characteristic_write_callback_t &callback) = 0;
+
   /**
    * @brief Check whether any central devices are connected.
    * @return true if at least one device is connected.
    */
   virtual bool hasConnectedDevices() = 0;
 
+  /**
+   * @brief Get the ATT MTU negotiated with a connected central.
+   * @param connection Connection of the central.
+   * @return The MTU in bytes, or the default MTU of 23 bytes if the central
+   *         is not connected.
+   */
+  virtual uint16_t getMtu(ConnectionHandle connection) = 0;
+
+  /**
+   * @brief Request new parameters for the connection to a central.
+   * @param connection Connection of the central.
+   * @param parameters Interval, latency and supervision timeout.
+   * @return true if the request was sent, false if the parameters are out
+   *         of the ranges allowed by the Bluetooth specification or the
+   *         stack did not send the request.
+   */
+  virtual bool
+  updateConnectionParameters(ConnectionHandle connection,
+                             const ConnectionParameters &parameters) = 0;
+
+  /**
+   * @brief Set the parameters requested from every central on connect,
+   *        instead of the preferred interval and default timeout.
+   * @param parameters Interval, latency and supervision timeout.
+   * @return false if the parameters are out of the ranges allowed by the
+   *         Bluetooth specification, the previous ones are kept then.
+   */
+  virtual bool
+  setConnectParameters(const ConnectionParameters &parameters) = 0;
+
   /**
    * @brief Configure the default connection timeout for newly connected
    *        devices.
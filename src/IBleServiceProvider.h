@@ -75,11 +75,24 @@ public:
    */
   virtual void onConnect(){};
 
+  /**
+   * @brief Notifies the provider that a central has connected, providers
+   *        keeping state per central override this instead of onConnect().
+   * @param connection Connection of the central.
+   */
+  virtual void onConnect(ConnectionHandle connection) { onConnect(); };
+
   /**
    * @brief Notifies the provider that a central has disconnected.
    */
   virtual void onDisconnect(){};
 
+  /**
+   * @brief Notifies the provider that a central has disconnected.
+   * @param connection Connection of the central.
+   */
+  virtual void onDisconnect(ConnectionHandle connection) { onDisconnect(); };
+
   /**
    * @brief Notifies the provider about subscription changes for a
    *        characteristic.
@@ -88,6 +101,34 @@ public:
    */
   virtual void onSubscribe(const std::string &uuid, uint16_t subValue){};
 
+  /**
+   * @brief Notifies the provider about subscription changes of a central.
+   * @param connection Connection of the subscribing central.
+   * @param uuid Characteristic UUID.
+   * @param subValue Subscription value/flags provided by the stack.
+   */
+  virtual void onSubscribe(ConnectionHandle connection,
+                           const std::string &uuid, const uint16_t subValue) {
+    onSubscribe(uuid, subValue);
+  };
+
+  /**
+   * @brief Notifies the provider that a notification or indication of a
+   *        characteristic has completed.
+   * @param uuid Characteristic UUID.
+   * @param success true if the value was sent or confirmed.
+   */
+  virtual void onNotifyStatus(const std::string &uuid, bool success){};
+
+  /**
+   * @brief Notifies the provider that the MTU or PHY of a connection
+   *        changed.
+   * @param connection Connection of the central.
+   * @param info The negotiated link properties.
+   */
+  virtual void onLinkUpdate(ConnectionHandle connection,
+                            const LinkInfo &info){};
+
 protected:
   /**
    * @brief Reference to the service library used to perform GATT operations.
@@ -31,6 +31,8 @@
 #ifndef PROVIDER_CALLBACKS_H
 #define PROVIDER_CALLBACKS_H
 
+#include "IBleServiceLibrary.h"
+
 #include <string>
 
 namespace sensirion::upt::ble_server {
@@ -44,20 +46,40 @@ public:
 
   /**
    * @brief Called when a central connects.
+   * @param connection Connection of the central.
    */
-  virtual void onConnect() = 0;
+  virtual void onConnect(ConnectionHandle connection) = 0;
 
   /**
    * @brief Called when a central disconnects.
+   * @param connection Connection of the central.
    */
-  virtual void onDisconnect() = 0;
+  virtual void onDisconnect(ConnectionHandle connection) = 0;
 
   /**
    * @brief Called when a subscription state changes for a characteristic.
+   * @param connection Connection of the subscribing central.
    * @param uuid Characteristic UUID.
    * @param subValue Subscription flags/value as provided by the BLE stack.
    */
-  virtual void onSubscribe(const std::string &uuid, uint16_t subValue) = 0;
+  virtual void onSubscribe(ConnectionHandle connection,
+                           const std::string &uuid, uint16_t subValue) = 0;
+
+  /**
+   * @brief Called when a notification or indication has been sent.
+   * @param uuid Characteristic UUID.
+   * @param success true if the notification was sent or the indication was
+   *        confirmed by the central, false if it failed or timed out.
+   */
+  virtual void onNotifyStatus(const std::string &uuid, bool success) = 0;
+
+  /**
+   * @brief Called when the MTU or PHY of a connection changed.
+   * @param connection Connection of the central.
+   * @param info The negotiated link properties.
+   */
+  virtual void onLinkUpdate(ConnectionHandle connection,
+                            const LinkInfo &info) = 0;
 };
 
 } // namespace sensirion::upt::ble_server
@@ -1,36 +1,187 @@
 #include "NimBLELibraryWrapper.h"
 #include <NimBLEDevice.h>
 #include <NimBLEServer.h>
+#include <cstring>
 
 namespace sensirion::upt::ble_server {
 
 static constexpr unsigned int INITIAL_NUMBER_OF_SERVICES = 4;
 static constexpr unsigned int INITIAL_NUMBER_OF_CHARACTERISTICS = 12;
 
+// Connections the stack accepts, set in the NimBLE configuration
+#ifndef CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 3
+#endif
+
+// The original ESP32 only supports the LE 1M PHY
+#ifndef BLE_SERVER_LE_2M_PHY_SUPPORTED
+#if defined(CONFIG_IDF_TARGET_ESP32)
+#define BLE_SERVER_LE_2M_PHY_SUPPORTED 0
+#else
+#define BLE_SERVER_LE_2M_PHY_SUPPORTED 1
+#endif
+#endif
+
+static uint8_t phyMask(const LinkPhy phy) {
+  // always allow 1M as fall back
+  switch (phy) {
+  case LinkPhy::LE_2M:
+    return BLE_GAP_LE_PHY_1M_MASK | BLE_GAP_LE_PHY_2M_MASK;
+  default:
+    return BLE_GAP_LE_PHY_1M_MASK;
+  }
+}
+
+// Connection parameters in the units of the stack
+struct ConnectionTicks {
+  uint16_t minInterval = 0; // 1.25 ms
+  uint16_t maxInterval = 0; // 1.25 ms
+  uint16_t latency = 0;
+  uint16_t timeout = 0; // 10 ms
+};
+
+// false if the parameters are out of the ranges allowed by the Bluetooth
+// specification, or the timeout does not exceed the time the peripheral may
+// be silent: (1 + latency) * maxInterval * 2
+static bool toConnectionTicks(const ConnectionParameters &parameters,
+                              ConnectionTicks &ticks) {
+  ticks.minInterval = static_cast<uint16_t>(parameters.minIntervalMs / 1.25f);
+  ticks.maxInterval = static_cast<uint16_t>(parameters.maxIntervalMs / 1.25f);
+  ticks.latency = parameters.latency;
+  ticks.timeout = static_cast<uint16_t>(parameters.supervisionTimeoutMs / 10);
+  if (ticks.minInterval < 6 || ticks.maxInterval > 3200 ||
+      ticks.minInterval > ticks.maxInterval || ticks.latency > 499 ||
+      ticks.timeout < 10 || ticks.timeout > 3200) {
+    return false;
+  }
+  // in units of 2.5 ms: timeout * 4, (1 + latency) * maxInterval
+  return static_cast<uint32_t>(ticks.timeout) * 4 >
+         (1u + ticks.latency) * ticks.maxInterval;
+}
+
 uint NimBLELibraryWrapper::mNumberOfInstances = 0;
 
+// Open addressing hash table from UUID strings to the index of the service
+// or characteristic, the UUIDs are converted to strings once on insert
+class UuidIndex {
+public:
+  void insert(const std::string &uuid, const uint16_t index) {
+    if (index >= mUuids.size()) {
+      mUuids.resize(index + 1);
+    }
+    mUuids[index] = uuid;
+    // keep the load factor at most 1/2
+    if (2 * mUuids.size() > mSlots.size()) {
+      rehash(mSlots.empty() ? 16 : 2 * mSlots.size());
+    } else {
+      insertSlot(index);
+    }
+  }
+
+  // Returns -1 if the UUID is unknown
+  [[nodiscard]] int find(const char *const uuid) const {
+    if (uuid == nullptr || mSlots.empty()) {
+      return -1;
+    }
+    const size_t mask = mSlots.size() - 1;
+    for (size_t slot = hash(uuid) & mask;; slot = (slot + 1) & mask) {
+      const uint16_t entry = mSlots[slot];
+      if (entry == 0) {
+        return -1;
+      }
+      if (strcmp(mUuids[entry - 1].c_str(), uuid) == 0) {
+        return entry - 1;
+      }
+    }
+  }
+
+  [[nodiscard]] const std::string &uuid(const uint16_t index) const {
+    return mUuids[index];
+  }
+
+private:
+  // FNV-1a
+  static uint32_t hash(const char *uuid) {
+    uint32_t hash = 2166136261u;
+    while (*uuid != '\0') {
+      hash = (hash ^ static_cast<uint8_t>(*uuid++)) * 16777619u;
+    }
+    return hash;
+  }
+
+  void insertSlot(const uint16_t index) {
+    const size_t mask = mSlots.size() - 1;
+    size_t slot = hash(mUuids[index].c_str()) & mask;
+    while (mSlots[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    // 0 marks an empty slot
+    mSlots[slot] = index + 1;
+  }
+
+  void rehash(const size_t slotCount) {
+    mSlots.assign(slotCount, 0);
+    for (uint16_t index = 0; index < mUuids.size(); ++index) {
+      insertSlot(index);
+    }
+  }
+
+  std::vector<std::string> mUuids;
+  std::vector<uint16_t> mSlots; // power of two size
+};
+
 struct WrapperPrivateData final : NimBLECharacteristicCallbacks,
                                   NimBLEServerCallbacks {
   NimBLEAdvertising *pNimBLEAdvertising{};
+  // advertisement as sent to the controller, the manufacturer data is
+  // rewritten in place by updateAdvertisingData
+  uint8_t advertisingPayload[BLE_HS_ADV_MAX_SZ] = {};
+  size_t advertisingPayloadSize = 0;
+  size_t manufacturerDataOffset = 0;
   bool BLEDeviceRunning = false;
-  std::unordered_map<std::string, std::vector<ble_service_callback_t>>
-      mCallbacks;
+  // write callbacks by characteristic handle
+  std::vector<std::vector<ble_characteristic_write_callback_t>> mCallbacks;
+  // callbacks registered before their characteristic was created
+  std::unordered_map<std::string,
+                     std::vector<ble_characteristic_write_callback_t>>
+      mPendingCallbacks;
 
   // owned by NimBLE
   NimBLEServer *pBLEServer{};
   std::vector<NimBLEService *> services{};
   std::vector<NimBLECharacteristic *> characteristics{};
+  UuidIndex serviceIndex;
+  UuidIndex characteristicIndex; // index is the characteristic handle
+
+  // Index of the characteristic, without converting its UUID to a string
+  [[nodiscard]] int characteristicIndexOf(
+      const NimBLECharacteristic *characteristic) const;
 
   // connection parameters
   uint16_t minConnectionIntervalTicks = 0;
   uint16_t maxConnectionIntervalTicks = 0;
   uint16_t defaultConnectionTimeoutTicks = 0;
   uint16_t latency = 3; // number of packets it is allowed to skip
+  LinkPhy preferredPhy = LinkPhy::LE_1M;
+  uint16_t preferredDataLength = 0;
+  std::unordered_map<uint16_t, LinkInfo> links; // by connection handle
+  // Link requests of a connection not sent yet. They follow the connection
+  // parameter update, as the controller runs one such procedure at a time,
+  // and are tried again with the next event if the stack did not send them.
+  struct PendingLinkRequests {
+    bool dataLength = false;
+    bool phy = false;
+  };
+  std::unordered_map<uint16_t, PendingLinkRequests> pendingLinkRequests;
+  void sendPendingLinkRequests(uint16_t connection);
 
   // Handle callbacks on characteristics write
-  void initCallbackForCharacteristic(const std::string &uuid);
+  void initCallbackForCharacteristic(const std::string &uuid,
+                                     CharacteristicHandle handle);
   void registerCallback(const char *uuid,
-                        const ble_service_callback_t &callback);
+                        const ble_characteristic_write_callback_t &callback);
+  void registerCallback(CharacteristicHandle handle,
+                        const ble_characteristic_write_callback_t &callback);
 
   // BLEServerCallbacks
   void onConnect(NimBLEServer *serverInst, NimBLEConnInfo &connInfo) override;
@@ -38,6 +189,13 @@ struct WrapperPrivateData final : NimBLECharacteristicCallbacks,
   void onDisconnect(NimBLEServer *serverInst, NimBLEConnInfo &connInfo,
                     int reason) override;
 
+  void onMTUChange(uint16_t mtu, NimBLEConnInfo &connInfo) override;
+
+  void onPhyUpdate(NimBLEConnInfo &connInfo, uint8_t txPhy,
+                   uint8_t rxPhy) override;
+
+  void onConnParamsUpdate(NimBLEConnInfo &connInfo) override;
+
   // BLECharacteristicCallbacks
   void onWrite(NimBLECharacteristic *characteristic,
                NimBLEConnInfo &connInfo) override;
@@ -45,27 +203,101 @@ struct WrapperPrivateData final : NimBLECharacteristicCallbacks,
   void onSubscribe(NimBLECharacteristic *characteristic,
                    NimBLEConnInfo &connInfo, uint16_t subValue) override;
 
+  void onStatus(NimBLECharacteristic *characteristic, int code) override;
+
   // DataProvider Callbacks
   IProviderCallbacks *providerCallbacks = nullptr;
 };
 
+int WrapperPrivateData::characteristicIndexOf(
+    const NimBLECharacteristic *characteristic) const {
+  for (size_t i = 0; i < characteristics.size(); ++i) {
+    if (characteristics[i] == characteristic) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
 void WrapperPrivateData::onConnect(NimBLEServer *serverInst,
                                    NimBLEConnInfo &connInfo) {
+  const uint16_t connHandle = connInfo.getConnHandle();
+  links[connHandle] = LinkInfo{};
+  PendingLinkRequests &pending = pendingLinkRequests[connHandle];
+  pending.dataLength = preferredDataLength > 0;
+  pending.phy = preferredPhy != LinkPhy::LE_1M;
+  // the pending requests follow with the update or its failure
+  if (!serverInst->updateConnParams(connHandle, minConnectionIntervalTicks,
+                                    maxConnectionIntervalTicks, latency,
+                                    defaultConnectionTimeoutTicks)) {
+    sendPendingLinkRequests(connHandle);
+  }
+  // advertising stops on connect, keep it running for further centrals
+  if (serverInst->getConnectedCount() < CONFIG_BT_NIMBLE_MAX_CONNECTIONS) {
+    pNimBLEAdvertising->start();
+  }
   if (providerCallbacks == nullptr) {
     return;
   }
-  pBLEServer->updateConnParams(
-      connInfo.getConnHandle(), minConnectionIntervalTicks,
-      maxConnectionIntervalTicks, latency, defaultConnectionTimeoutTicks);
-  providerCallbacks->onConnect();
+  providerCallbacks->onConnect(connInfo.getConnHandle());
 }
 
 void WrapperPrivateData::onDisconnect(BLEServer *serverInst,
                                       NimBLEConnInfo &connInfo, int reason) {
+  links.erase(connInfo.getConnHandle());
+  pendingLinkRequests.erase(connInfo.getConnHandle());
   if (providerCallbacks == nullptr) {
     return;
   }
-  providerCallbacks->onDisconnect();
+  providerCallbacks->onDisconnect(connInfo.getConnHandle());
+}
+
+void WrapperPrivateData::onMTUChange(const uint16_t mtu,
+                                     NimBLEConnInfo &connInfo) {
+  sendPendingLinkRequests(connInfo.getConnHandle());
+  LinkInfo &link = links[connInfo.getConnHandle()];
+  link.mtu = mtu;
+  if (providerCallbacks == nullptr) {
+    return;
+  }
+  providerCallbacks->onLinkUpdate(connInfo.getConnHandle(), link);
+}
+
+void WrapperPrivateData::onPhyUpdate(NimBLEConnInfo &connInfo,
+                                     const uint8_t txPhy,
+                                     const uint8_t rxPhy) {
+  sendPendingLinkRequests(connInfo.getConnHandle());
+  // the BLE_GAP_LE_PHY_* values match LinkPhy
+  LinkInfo &link = links[connInfo.getConnHandle()];
+  link.txPhy = static_cast<LinkPhy>(txPhy);
+  link.rxPhy = static_cast<LinkPhy>(rxPhy);
+  if (providerCallbacks == nullptr) {
+    return;
+  }
+  providerCallbacks->onLinkUpdate(connInfo.getConnHandle(), link);
+}
+
+void WrapperPrivateData::onConnParamsUpdate(NimBLEConnInfo &connInfo) {
+  sendPendingLinkRequests(connInfo.getConnHandle());
+}
+
+void WrapperPrivateData::sendPendingLinkRequests(const uint16_t connection) {
+  const auto found = pendingLinkRequests.find(connection);
+  if (found == pendingLinkRequests.end()) {
+    return;
+  }
+  PendingLinkRequests &pending = found->second;
+  if (pending.dataLength) {
+    pending.dataLength =
+        !pBLEServer->setDataLen(connection, preferredDataLength);
+  }
+  if (pending.phy) {
+    const uint8_t mask = phyMask(preferredPhy);
+    pending.phy = !pBLEServer->updatePhy(connection, mask, mask, 0);
+  }
+  if (!pending.dataLength && !pending.phy) {
+    pendingLinkRequests.erase(found);
+  }
 }
 
 void WrapperPrivateData::onSubscribe(NimBLECharacteristic *characteristic,
@@ -75,35 +307,77 @@ void WrapperPrivateData::onSubscribe(NimBLECharacteristic *characteristic,
     return;
   }
 
-  providerCallbacks->onSubscribe(characteristic->getUUID().toString(),
+  providerCallbacks->onSubscribe(connInfo.getConnHandle(),
+                                 characteristic->getUUID().toString(),
                                  subValue);
 }
 
+void WrapperPrivateData::onStatus(NimBLECharacteristic *characteristic,
+                                  const int code) {
+  if (providerCallbacks == nullptr) {
+    return;
+  }
+  // 0: notification sent, BLE_HS_EDONE: indication confirmed by the central
+  const bool success = code == 0 || code == BLE_HS_EDONE;
+  // called for every download packet, avoid converting the UUID
+  const int index = characteristicIndexOf(characteristic);
+  if (index < 0) {
+    return;
+  }
+  providerCallbacks->onNotifyStatus(
+      characteristicIndex.uuid(static_cast<uint16_t>(index)), success);
+}
+
 void WrapperPrivateData::onWrite(BLECharacteristic *characteristic,
                                  NimBLEConnInfo &connInfo) {
-  const std::string uuid = characteristic->getUUID().toString();
-
-  if (mCallbacks.find(uuid) == mCallbacks.end()) {
+  const int handle = characteristicIndexOf(characteristic);
+  if (handle < 0 || mCallbacks[handle].empty()) {
     // no callbacks registered for characteristic
     return;
   }
 
-  const std::string value = characteristic->getValue();
-  for (const auto &callback : mCallbacks[uuid]) {
-    callback(value);
+  // the stack only hands out a copy of the value, share it with all callbacks
+  const NimBLEAttValue value = characteristic->getValue();
+  const ByteView view{value.data(), value.size()};
+  for (const auto &callback : mCallbacks[handle]) {
+    callback(connInfo.getConnHandle(), view);
   }
 }
 
 void WrapperPrivateData::initCallbackForCharacteristic(
-    const std::string &uuid) {
-  if (mCallbacks.find(uuid) == mCallbacks.end()) {
-    mCallbacks[uuid].reserve(3);
+    const std::string &uuid, const CharacteristicHandle handle) {
+  if (handle >= mCallbacks.size()) {
+    mCallbacks.resize(handle + 1);
+  }
+  mCallbacks[handle].reserve(3);
+  const auto pending = mPendingCallbacks.find(uuid);
+  if (pending != mPendingCallbacks.end()) {
+    for (const auto &callback : pending->second) {
+      mCallbacks[handle].push_back(callback);
+    }
+    mPendingCallbacks.erase(pending);
   }
 }
 
 void WrapperPrivateData::registerCallback(
-    const char *const uuid, const ble_service_callback_t &callback) {
-  mCallbacks[uuid].push_back(callback);
+    const char *const uuid,
+    const ble_characteristic_write_callback_t &callback) {
+  const int handle = characteristicIndex.find(uuid);
+  if (handle < 0) {
+    // the characteristic is not created yet
+    mPendingCallbacks[uuid].push_back(callback);
+    return;
+  }
+  registerCallback(static_cast<CharacteristicHandle>(handle), callback);
+}
+
+void WrapperPrivateData::registerCallback(
+    const CharacteristicHandle handle,
+    const ble_characteristic_write_callback_t &callback) {
+  if (handle >= mCallbacks.size()) {
+    return;
+  }
+  mCallbacks[handle].push_back(callback);
 }
 
 WrapperPrivateData *NimBLELibraryWrapper::mData = nullptr;
@@ -196,6 +470,8 @@ bool NimBLELibraryWrapper::createService(const char *const uuid) {
     return true;
   }
   const auto service = mData->pBLEServer->createService(uuid);
+  mData->serviceIndex.insert(service->getUUID().toString(),
+                             static_cast<uint16_t>(mData->services.size()));
   mData->services.push_back(service);
   return true;
 }
@@ -225,6 +501,9 @@ bool NimBLELibraryWrapper::createCharacteristic(
   if (permission == Permission::NOTIFY_PERMISSION) {
     nimbleProperty |= NOTIFY;
   }
+  if (permission == Permission::WRITE_NO_RESPONSE_PERMISSION) {
+    nimbleProperty |= WRITE_NR;
+  }
 
   if (nimbleProperty == 0) {
     // don't create characteristics with no permission
@@ -234,8 +513,12 @@ bool NimBLELibraryWrapper::createCharacteristic(
   NimBLECharacteristic *characteristic =
       service->createCharacteristic(characteristicUuid, nimbleProperty);
   characteristic->setCallbacks(mData);
-  mData->initCallbackForCharacteristic(characteristicUuid);
+  const auto handle =
+      static_cast<CharacteristicHandle>(mData->characteristics.size());
+  mData->characteristicIndex.insert(characteristic->getUUID().toString(),
+                                    handle);
   mData->characteristics.push_back(characteristic);
+  mData->initCallbackForCharacteristic(characteristicUuid, handle);
   return true;
 }
 
@@ -253,6 +536,32 @@ void NimBLELibraryWrapper::setAdvertisingData(const std::string &data) {
   advert.setName(GADGET_NAME);
   advert.setManufacturerData(data);
   mData->pNimBLEAdvertising->setAdvertisementData(advert);
+
+  const std::vector<uint8_t> payload = advert.getPayload();
+  mData->advertisingPayloadSize = 0;
+  if (payload.size() <= sizeof(mData->advertisingPayload) &&
+      payload.size() >= data.size()) {
+    memcpy(mData->advertisingPayload, payload.data(), payload.size());
+    mData->advertisingPayloadSize = payload.size();
+    // the manufacturer data is the last AD structure
+    mData->manufacturerDataOffset = payload.size() - data.size();
+  }
+}
+
+bool NimBLELibraryWrapper::updateAdvertisingData(const uint8_t *data,
+                                                 const size_t size) {
+  if (mData->advertisingPayloadSize == 0 ||
+      mData->manufacturerDataOffset + size != mData->advertisingPayloadSize) {
+    // layout changed, needs setAdvertisingData
+    return false;
+  }
+  memcpy(&mData->advertisingPayload[mData->manufacturerDataOffset], data,
+         size);
+  // the controller sends the new data from the next advertising event on
+  const int rc =
+      ble_gap_adv_set_data(mData->advertisingPayload,
+                           static_cast<int>(mData->advertisingPayloadSize));
+  return rc == 0;
 }
 
 void NimBLELibraryWrapper::startAdvertising() {
@@ -278,6 +587,23 @@ bool NimBLELibraryWrapper::characteristicSetValue(const char *const uuid,
   return true;
 }
 
+CharacteristicHandle
+NimBLELibraryWrapper::getCharacteristicHandle(const char *const uuid) {
+  const int index = mData->characteristicIndex.find(uuid);
+  return index < 0 ? INVALID_CHARACTERISTIC_HANDLE
+                   : static_cast<CharacteristicHandle>(index);
+}
+
+bool NimBLELibraryWrapper::characteristicSetValue(
+    const CharacteristicHandle handle, const uint8_t *data, const size_t size) {
+  NimBLECharacteristic *pCharacteristic = lookupCharacteristic(handle);
+  if (nullptr == pCharacteristic) {
+    return false;
+  }
+  pCharacteristic->setValue(data, size);
+  return true;
+}
+
 bool NimBLELibraryWrapper::characteristicSetValue(const char *const uuid,
                                                   const int value) {
   NimBLECharacteristic *pCharacteristic = lookupCharacteristic(uuid);
@@ -313,55 +639,141 @@ NimBLELibraryWrapper::characteristicGetValue(const char *const uuid) {
 }
 
 bool NimBLELibraryWrapper::characteristicNotify(const char *const uuid) {
+  return characteristicNotify(uuid, TransmitMode::INDICATE);
+}
+
+bool NimBLELibraryWrapper::characteristicNotify(const char *const uuid,
+                                                const TransmitMode mode) {
   const NimBLECharacteristic *pCharacteristic = lookupCharacteristic(uuid);
   if (nullptr == pCharacteristic) {
     return false;
   }
+  if (mode == TransmitMode::NOTIFY) {
+    return pCharacteristic->notify();
+  }
+  return pCharacteristic->indicate();
+}
+
+bool NimBLELibraryWrapper::characteristicNotify(
+    const CharacteristicHandle handle, const TransmitMode mode) {
+  const NimBLECharacteristic *pCharacteristic = lookupCharacteristic(handle);
+  if (nullptr == pCharacteristic) {
+    return false;
+  }
+  if (mode == TransmitMode::NOTIFY) {
+    return pCharacteristic->notify();
+  }
   return pCharacteristic->indicate();
 }
+
+bool NimBLELibraryWrapper::characteristicNotify(
+    const CharacteristicHandle handle, const uint8_t *data, const size_t size,
+    const ConnectionHandle connection, const TransmitMode mode) {
+  const NimBLECharacteristic *pCharacteristic = lookupCharacteristic(handle);
+  if (nullptr == pCharacteristic) {
+    return false;
+  }
+  if (mode == TransmitMode::NOTIFY) {
+    return pCharacteristic->notify(data, size, connection);
+  }
+  return pCharacteristic->indicate(data, size, connection);
+}
+
 void NimBLELibraryWrapper::registerCharacteristicCallback(
     const char *uuid, const ble_service_callback_t &callback) {
+  // adapter for callbacks taking the value as string
+  mData->registerCallback(
+      uuid, [callback](ConnectionHandle /*connection*/, const ByteView value) {
+        callback(std::string(reinterpret_cast<const char *>(value.data),
+                             value.size));
+      });
+}
+
+void NimBLELibraryWrapper::registerCharacteristicCallback(
+    const char *uuid, const ble_characteristic_write_callback_t &callback) {
   mData->registerCallback(uuid, callback);
 }
 
+void NimBLELibraryWrapper::registerCharacteristicCallback(
+    const CharacteristicHandle handle,
+    const ble_characteristic_write_callback_t &callback) {
+  mData->registerCallback(handle, callback);
+}
+
 void NimBLELibraryWrapper::setProviderCallbacks(
     IProviderCallbacks *providerCallbacks) {
   mData->providerCallbacks = providerCallbacks;
 }
+bool NimBLELibraryWrapper::setPreferredPhy(const LinkPhy phy) {
+  // the coded PHY is not supported on the ESP32
+  if (phy == LinkPhy::LE_CODED ||
+      (phy == LinkPhy::LE_2M && !BLE_SERVER_LE_2M_PHY_SUPPORTED)) {
+    return false;
+  }
+  mData->preferredPhy = phy;
+  return true;
+}
+bool NimBLELibraryWrapper::setPreferredDataLength(const uint16_t octets) {
+  if (octets != 0 && (octets < 27 || octets > 251)) {
+    return false;
+  }
+  mData->preferredDataLength = octets;
+  return true;
+}
 bool NimBLELibraryWrapper::hasConnectedDevices() {
   return mData->pBLEServer->getConnectedCount() > 0;
 }
+uint16_t NimBLELibraryWrapper::getMtu(const ConnectionHandle connection) {
+  // 0 if the central is not connected
+  const uint16_t mtu = mData->pBLEServer->getPeerMTU(connection);
+  return mtu < BLE_ATT_MTU_DFLT ? BLE_ATT_MTU_DFLT : mtu;
+}
+bool NimBLELibraryWrapper::updateConnectionParameters(
+    const ConnectionHandle connection, const ConnectionParameters &parameters) {
+  ConnectionTicks ticks;
+  if (!toConnectionTicks(parameters, ticks)) {
+    return false;
+  }
+  return mData->pBLEServer->updateConnParams(connection, ticks.minInterval,
+                                             ticks.maxInterval, ticks.latency,
+                                             ticks.timeout);
+}
+
+bool NimBLELibraryWrapper::setConnectParameters(
+    const ConnectionParameters &parameters) {
+  ConnectionTicks ticks;
+  if (!toConnectionTicks(parameters, ticks)) {
+    return false;
+  }
+  mData->minConnectionIntervalTicks = ticks.minInterval;
+  mData->maxConnectionIntervalTicks = ticks.maxInterval;
+  mData->latency = ticks.latency;
+  mData->defaultConnectionTimeoutTicks = ticks.timeout;
+  return true;
+}
 void NimBLELibraryWrapper::setDefaultConnectionTimeout(
     const uint16_t timeoutMs) {
   mDefaultConnectionTimeoutTicks = static_cast<uint16_t>(timeoutMs / 10);
   mData->defaultConnectionTimeoutTicks = mDefaultConnectionTimeoutTicks;
 }
 
-template <typename Container, typename UuidGetter>
-typename Container::value_type findByUuid(Container &container,
-                                          const char *const targetUuid,
-                                          UuidGetter getUuid) {
-  if (targetUuid == nullptr) {
-    return nullptr;
-  }
-
-  const std::string targetUuidSw{targetUuid};
-
-  const auto it =
-      std::find_if(container.begin(), container.end(),
-                   [&](auto *elem) { return getUuid(elem) == targetUuidSw; });
-  return it != container.end() ? *it : nullptr;
+NimBLECharacteristic *
+NimBLELibraryWrapper::lookupCharacteristic(const char *const uuid) {
+  const int index = mData->characteristicIndex.find(uuid);
+  return index < 0 ? nullptr : mData->characteristics[index];
 }
 
 NimBLECharacteristic *
-NimBLELibraryWrapper::lookupCharacteristic(const char *const uuid) {
-  return findByUuid(mData->characteristics, uuid,
-                    [](auto *elem) { return elem->getUUID().toString(); });
+NimBLELibraryWrapper::lookupCharacteristic(const CharacteristicHandle handle) {
+  if (handle >= mData->characteristics.size()) {
+    return nullptr;
+  }
+  return mData->characteristics[handle];
 }
 
 NimBLEService *NimBLELibraryWrapper::lookupService(const char *const uuid) {
-  return findByUuid(mData->services, uuid,
-                    [](auto *elem) { return elem->getUUID().toString(); });
+  const int index = mData->serviceIndex.find(uuid);
+  return index < 0 ? nullptr : mData->services[index];
 }
 
 } // namespace sensirion::upt::ble_server
\ No newline at end of file
@@ -95,6 +95,8 @@ public:
 
   void setAdvertisingData(const std::string &data) override;
 
+  bool updateAdvertisingData(const uint8_t *data, size_t size) override;
+
   void startAdvertising() override;
 
   void stopAdvertising() override;
@@ -104,6 +106,11 @@ public:
   bool characteristicSetValue(const char *uuid, const uint8_t *data,
                               size_t size) override;
 
+  CharacteristicHandle getCharacteristicHandle(const char *uuid) override;
+
+  bool characteristicSetValue(CharacteristicHandle handle, const uint8_t *data,
+                              size_t size) override;
+
   bool characteristicSetValue(const char *uuid, int value) override;
 
   bool characteristicSetValue(const char *uuid, uint32_t value) override;
@@ -114,13 +121,42 @@ public:
 
   bool characteristicNotify(const char *uuid) override;
 
+  bool characteristicNotify(const char *uuid, TransmitMode mode) override;
+
+  bool characteristicNotify(CharacteristicHandle handle,
+                            TransmitMode mode) override;
+
+  bool characteristicNotify(CharacteristicHandle handle, const uint8_t *data,
+                            size_t size, ConnectionHandle connection,
+                            TransmitMode mode) override;
+
   void registerCharacteristicCallback(
       const char *uuid, const ble_service_callback_t &callback) override;
 
+  void registerCharacteristicCallback(
+      const char *uuid,
+      const ble_characteristic_write_callback_t &callback) override;
+
+  void registerCharacteristicCallback(
+      CharacteristicHandle handle,
+      const ble_characteristic_write_callback_t &callback) override;
+
   void setProviderCallbacks(IProviderCallbacks *providerCallbacks) override;
 
+  bool setPreferredPhy(LinkPhy phy) override;
+
+  bool setPreferredDataLength(uint16_t octets) override;
+
   bool hasConnectedDevices() override;
 
+  uint16_t getMtu(ConnectionHandle connection) override;
+
+  bool
+  updateConnectionParameters(ConnectionHandle connection,
+                             const ConnectionParameters &parameters) override;
+
+  bool setConnectParameters(const ConnectionParameters &parameters) override;
+
   void setDefaultConnectionTimeout(uint16_t timeoutMs) override;
 
 private:
@@ -128,6 +164,9 @@ private:
 
   static NimBLECharacteristic *lookupCharacteristic(const char *uuid);
 
+  static NimBLECharacteristic *
+  lookupCharacteristic(CharacteristicHandle handle);
+
   static NimBLEService *lookupService(const char *uuid);
 
 private:
@@ -8,4 +8,9 @@ void Sample::writeValue(uint16_t value, size_t position) {
 
 void Sample::setByte(uint8_t byte, size_t position) { mData[position] = byte; }
 
+void Sample::setData(const uint8_t *data, const size_t size) {
+  assert(size <= MAX_SAMPLE_SIZE_BYTES);
+  memcpy(mData.data(), data, size);
+}
+
 } // namespace sensirion::upt::ble_server
\ No newline at end of file
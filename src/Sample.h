@@ -36,14 +36,30 @@
 
 namespace sensirion::upt::ble_server {
 
-static constexpr size_t SAMPLE_SIZE_BYTES = 12;
+#ifndef BLE_SERVER_MAX_SAMPLE_SIZE_BYTES
+#define BLE_SERVER_MAX_SAMPLE_SIZE_BYTES 20
+#endif
 
-// Holds sensor values following the set SampleConfig
-class Sample : public ByteArray<SAMPLE_SIZE_BYTES> {
+// Largest sample size of a SampleConfig, sets the size of every sample buffer
+static constexpr size_t MAX_SAMPLE_SIZE_BYTES =
+    BLE_SERVER_MAX_SAMPLE_SIZE_BYTES;
+// The advertisement carries the first bytes of a sample
+static constexpr size_t ADVERTISED_SAMPLE_SIZE_BYTES = 12;
+
+// slot masks of the history hold 16 slots
+static_assert(MAX_SAMPLE_SIZE_BYTES >= ADVERTISED_SAMPLE_SIZE_BYTES &&
+                  MAX_SAMPLE_SIZE_BYTES <= 32,
+              "max sample size must be 12 to 32 bytes");
+
+// Holds sensor values following the set SampleConfig, which uses the first
+// sampleSizeBytes of it
+class Sample : public ByteArray<MAX_SAMPLE_SIZE_BYTES> {
 public:
   void writeValue(uint16_t value, size_t position);
 
   void setByte(uint8_t byte, size_t position);
+
+  void setData(const uint8_t *data, size_t size);
 };
 
 } // namespace sensirion::upt::ble_server
@@ -0,0 +1,62 @@
+#include "SampleAccumulator.h"
+
+namespace sensirion::upt::ble_server {
+
+void SampleAccumulator::setMode(const AggregationMode mode) {
+  mMode = mode;
+  reset();
+}
+
+void SampleAccumulator::writeValue(const float value, const size_t slotIndex) {
+  if (slotIndex >= MAX_SLOTS) {
+    return;
+  }
+  mLatest[slotIndex] = value;
+  mWritten[slotIndex] = true;
+}
+
+void SampleAccumulator::commit() {
+  for (size_t i = 0; i < MAX_SLOTS; ++i) {
+    if (!mWritten[i]) {
+      continue;
+    }
+    const float value = mLatest[i];
+    if (mCount[i] == 0 || value < mMin[i]) {
+      mMin[i] = value;
+    }
+    if (mCount[i] == 0 || value > mMax[i]) {
+      mMax[i] = value;
+    }
+    mSum[i] += value;
+    ++mCount[i];
+  }
+}
+
+bool SampleAccumulator::hasValue(const size_t slotIndex) const {
+  return slotIndex < MAX_SLOTS && mCount[slotIndex] > 0;
+}
+
+float SampleAccumulator::value(const size_t slotIndex) const {
+  switch (mMode) {
+  case AggregationMode::MEAN:
+    return static_cast<float>(mSum[slotIndex] / mCount[slotIndex]);
+  case AggregationMode::MIN:
+    return mMin[slotIndex];
+  case AggregationMode::MAX:
+    return mMax[slotIndex];
+  default:
+    return mLatest[slotIndex];
+  }
+}
+
+void SampleAccumulator::reset() {
+  mSum.fill(0);
+  mCount.fill(0);
+}
+
+void SampleAccumulator::clear() {
+  reset();
+  mWritten.fill(false);
+}
+
+} // namespace sensirion::upt::ble_server
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SAMPLE_ACCUMULATOR_H
+#define SAMPLE_ACCUMULATOR_H
+
+#include "Sample.h"
+
+#include <array>
+
+namespace sensirion::upt::ble_server {
+
+// How the values committed during a history interval are combined into the
+// history sample
+enum class AggregationMode : uint8_t { LATEST, MEAN, MIN, MAX };
+
+// Aggregates the values of committed samples per 16 bit slot
+class SampleAccumulator {
+public:
+  void setMode(AggregationMode mode);
+
+  // Sets the value of the slot for the next commit
+  void writeValue(float value, size_t slotIndex);
+
+  // Adds the latest written value of every slot to the aggregate
+  void commit();
+
+  [[nodiscard]] bool hasValue(size_t slotIndex) const;
+
+  [[nodiscard]] float value(size_t slotIndex) const;
+
+  // Starts a new aggregate, the latest written values are kept
+  void reset();
+
+  // Also forgets the latest written values
+  void clear();
+
+  static constexpr size_t MAX_SLOTS = MAX_SAMPLE_SIZE_BYTES / 2;
+
+private:
+  AggregationMode mMode = AggregationMode::MEAN;
+  std::array<float, MAX_SLOTS> mLatest = {};
+  std::array<bool, MAX_SLOTS> mWritten = {};
+  std::array<double, MAX_SLOTS> mSum = {};
+  std::array<float, MAX_SLOTS> mMin = {};
+  std::array<float, MAX_SLOTS> mMax = {};
+  std::array<uint32_t, MAX_SLOTS> mCount = {};
+};
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* SAMPLE_ACCUMULATOR_H */
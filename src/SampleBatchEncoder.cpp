@@ -0,0 +1,177 @@
+#include "SampleBatchEncoder.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sensirion::upt::ble_server {
+
+namespace {
+
+using EncodingFunction = std::function<uint16_t(float)>;
+
+// Fewer levels between the probed steps don't give a precise scale
+constexpr uint16_t MIN_PROBED_LEVELS = 256;
+
+// Smallest value in (low, high] encoded to at least level, the encoding must
+// be increasing in between
+float stepPosition(const EncodingFunction &encodingFunction, float low,
+                   float high, const uint16_t level) {
+  while (true) {
+    const float middle = low + (high - low) / 2;
+    if (middle <= low || middle >= high) {
+      return high;
+    }
+    if (encodingFunction(middle) >= level) {
+      high = middle;
+    } else {
+      low = middle;
+    }
+  }
+}
+
+// Compares the encodings at values spread over the clamped range, they have
+// to be equal wherever the affine encoding is used
+bool reproduces(const EncodingFunction &encodingFunction,
+                const AffineEncoding &encoding) {
+  constexpr int NUMBER_OF_VALUES = 1024;
+  const float span = encoding.highest - encoding.lowest;
+  for (int i = 0; i < NUMBER_OF_VALUES; ++i) {
+    // off the integer levels, where both encodings are well defined
+    const float level =
+        encoding.lowest + span * (i + 0.37f) / NUMBER_OF_VALUES;
+    const float value = (level - encoding.offset) / encoding.scale;
+    if (encoding.isExact(value) &&
+        encodingFunction(value) != encoding(value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+bool probeAffineEncoding(const EncodingFunction &encodingFunction,
+                         AffineEncoding &encoding) {
+  if (!encodingFunction) {
+    return false;
+  }
+  const uint16_t zeroLevel = encodingFunction(0.0f);
+  if (zeroLevel > UINT16_MAX - MIN_PROBED_LEVELS) {
+    return false;
+  }
+  // the first step above zero
+  float near = 1.0f / 1024;
+  while (encodingFunction(near) <= zeroLevel) {
+    near *= 2;
+    if (near > 1e6f) {
+      return false; // constant or decreasing
+    }
+  }
+  // a step far above, before the encoding saturates or wraps around
+  float far = near;
+  while (far < 1e9f) {
+    const uint16_t level = encodingFunction(2 * far);
+    if (level < encodingFunction(far) || level == UINT16_MAX) {
+      break;
+    }
+    far *= 2;
+  }
+  const uint16_t nearLevel = zeroLevel + 1;
+  const uint16_t farLevel = encodingFunction(far);
+  if (farLevel < nearLevel + MIN_PROBED_LEVELS) {
+    return false;
+  }
+  const double nearStep = stepPosition(encodingFunction, 0, near, nearLevel);
+  const double farStep = stepPosition(encodingFunction, 0, far, farLevel);
+  const double scale = (farLevel - nearLevel) / (farStep - nearStep);
+  // a value right at a step is truncated to the level of the step
+  const double offset = nearLevel - nearStep * scale;
+
+  // The encoding functions truncate to 16 bit, the bounds match how they
+  // behave outside their range: wrapping around, unsigned or signed.
+  constexpr float BOUNDS[][2] = {
+      {-32768.0f, 65535.0f}, {0.0f, 65535.0f}, {-32768.0f, 32767.0f}};
+  for (const double candidateOffset : {offset, offset - 65536.0}) {
+    for (const auto &bounds : BOUNDS) {
+      AffineEncoding candidate;
+      candidate.scale = static_cast<float>(scale);
+      candidate.offset = static_cast<float>(candidateOffset);
+      candidate.lowest = bounds[0];
+      candidate.highest = bounds[1];
+      if (reproduces(encodingFunction, candidate)) {
+        encoding = candidate;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void SampleBatchEncoder::setSampleConfig(
+    const core::SampleConfig &sampleConfig) {
+  mEncodings = {};
+  for (const auto &[signalType, slot] : sampleConfig.sampleSlots) {
+    const auto index = static_cast<size_t>(signalType);
+    if (index >= mEncodings.size()) {
+      continue;
+    }
+    ColumnEncoding &encoding = mEncodings[index];
+    encoding.encodingFunction = slot.encodingFunction;
+    encoding.offset = slot.offset;
+    encoding.isAffine =
+        probeAffineEncoding(slot.encodingFunction, encoding.affineEncoding);
+  }
+}
+
+bool SampleBatchEncoder::encodeColumn(const core::SignalType signalType,
+                                      const float *values, const size_t count,
+                                      uint8_t *records,
+                                      const size_t recordSize) const {
+  const auto index = static_cast<size_t>(signalType);
+  if (index >= mEncodings.size() || !mEncodings[index].encodingFunction) {
+    return false;
+  }
+  const ColumnEncoding &column = mEncodings[index];
+  if (count == 0) {
+    return true;
+  }
+
+  uint16_t encoded[BLOCK_SIZE];
+  // NaN values keep the latest slot value, starting with the first record's
+  uint16_t latest = records[column.offset] | records[column.offset + 1] << 8;
+  for (size_t first = 0; first < count; first += BLOCK_SIZE) {
+    const size_t blockCount = std::min(BLOCK_SIZE, count - first);
+    const float *block = &values[first];
+    if (column.isAffine) {
+      encodeValues(column.affineEncoding, block, blockCount, encoded);
+      // the function decides at steps and outside the probed range
+      for (size_t i = 0; i < blockCount; ++i) {
+        if (!std::isnan(block[i]) &&
+            !column.affineEncoding.isExact(block[i])) {
+          encoded[i] = column.encodingFunction(block[i]);
+        }
+      }
+    } else {
+      const auto encodeValue = [&column](const float value) -> uint16_t {
+        return std::isnan(value) ? 0 : column.encodingFunction(value);
+      };
+      encodeValues(encodeValue, block, blockCount, encoded);
+    }
+    for (size_t i = 0; i < blockCount; ++i) {
+      if (!std::isnan(block[i])) {
+        latest = encoded[i];
+      }
+      uint8_t *slot = &records[(first + i) * recordSize + column.offset];
+      slot[0] = static_cast<uint8_t>(latest);
+      slot[1] = static_cast<uint8_t>(latest >> 8);
+    }
+  }
+  return true;
+}
+
+bool SampleBatchEncoder::isAffine(const core::SignalType signalType) const {
+  const auto index = static_cast<size_t>(signalType);
+  return index < mEncodings.size() && mEncodings[index].isAffine;
+}
+
+} // namespace sensirion::upt::ble_server
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SAMPLE_BATCH_ENCODER_H
+#define SAMPLE_BATCH_ENCODER_H
+
+#include "Sample.h"
+
+#include <BLEProtocol.h>
+#include <array>
+#include <cmath>
+#include <functional>
+
+namespace sensirion::upt::ble_server {
+
+// Signal types up to UNDEFINED are looked up in slot tables
+static constexpr size_t NUMBER_OF_SIGNAL_TYPES =
+    static_cast<size_t>(core::SignalType::UNDEFINED) + 1;
+
+// Encoding of a slot as value * scale + offset, clamped to [lowest, highest],
+// rounded down and truncated to 16 bit. The bounds cover both unsigned and
+// two's complement slots, the rounding of an encoder is part of the offset.
+struct AffineEncoding {
+  // Encoded values closer than this to a step of the encoding may be
+  // rounded differently than by the encoding function
+  static constexpr float STEP_MARGIN = 1.0f / 16;
+  static constexpr int32_t LOWEST_LEVEL = -32768;
+
+  float scale = 1.0f;
+  float offset = 0.0f;
+  float lowest = -32768.0f;
+  float highest = 65535.0f;
+
+  uint16_t operator()(const float value) const {
+    float encoded = value * scale + offset;
+    // written so that NaN ends up at lowest
+    encoded = encoded > lowest ? encoded : lowest;
+    encoded = encoded < highest ? encoded : highest;
+    // truncating the value shifted to be positive rounds it down
+    return static_cast<uint16_t>(
+        static_cast<int32_t>(encoded - LOWEST_LEVEL) + LOWEST_LEVEL);
+  }
+
+  // Whether the value is encoded exactly like by the probed function: it is
+  // within the bounds and not at a step, where rounding errors could differ
+  [[nodiscard]] bool isExact(const float value) const {
+    const float encoded = value * scale + offset;
+    if (!(encoded >= lowest && encoded <= highest)) {
+      return false;
+    }
+    const float fraction = encoded - std::floor(encoded);
+    return fraction >= STEP_MARGIN && fraction <= 1.0f - STEP_MARGIN;
+  }
+};
+
+// Finds the affine encoding that reproduces encodingFunction, false if the
+// function is not affine. Values for which the affine encoding is not exact
+// have to be encoded by the function.
+bool probeAffineEncoding(const std::function<uint16_t(float)> &encodingFunction,
+                         AffineEncoding &encoding);
+
+// Encodes count values into encoded. Instantiated with AffineEncoding the
+// loop has no calls or branches and is vectorized by the compiler, values
+// it does not encode exactly are encoded again by the function afterwards.
+template <typename Encoding>
+void encodeValues(const Encoding &encoding, const float *values,
+                  const size_t count, uint16_t *encoded) {
+  for (size_t i = 0; i < count; ++i) {
+    encoded[i] = encoding(values[i]);
+  }
+}
+
+// Encodes columns of values of one signal type into sample records
+class SampleBatchEncoder {
+public:
+  // Resolves the slots and probes their encodings
+  void setSampleConfig(const core::SampleConfig &sampleConfig);
+
+  // Writes count values into the slot of the signal type of count records
+  // of recordSize bytes. A NaN value keeps the slot value of the record
+  // before. Returns false if the signal type is not part of the sample.
+  bool encodeColumn(core::SignalType signalType, const float *values,
+                    size_t count, uint8_t *records, size_t recordSize) const;
+
+  // Whether the values of the signal type are encoded by the affine kernel
+  [[nodiscard]] bool isAffine(core::SignalType signalType) const;
+
+private:
+  // Values are encoded in blocks of this size on the stack
+  static constexpr size_t BLOCK_SIZE = 64;
+
+  struct ColumnEncoding {
+    std::function<uint16_t(float)> encodingFunction; // empty if not sampled
+    size_t offset = 0;
+    bool isAffine = false;
+    AffineEncoding affineEncoding;
+  };
+
+  std::array<ColumnEncoding, NUMBER_OF_SIGNAL_TYPES> mEncodings;
+};
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* SAMPLE_BATCH_ENCODER_H */
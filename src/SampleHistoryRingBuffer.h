@@ -33,30 +33,61 @@
 
 #include "ByteArray.h"
 #include "Sample.h"
+#include "SampleOverflowBuffer.h"
+
+#include <cstring>
 
 namespace sensirion::upt::ble_server {
 
 static constexpr size_t SAMPLE_HISTORY_RING_BUFFER_SIZE_BYTES = 30000;
 
-// Logs Samples over time to be downloaded
-template <size_t BUFFER_SIZE = SAMPLE_HISTORY_RING_BUFFER_SIZE_BYTES>
+// Non-owning view on contiguous sample data in the history memory
+struct SampleSpan {
+  const uint8_t *data = nullptr;
+  size_t sizeBytes = 0;
+};
+
+// Logs Samples over time to be downloaded. The range given to startReadOut
+// is pinned until endReadOut: samples that would overwrite it are held in an
+// overflow buffer and added once the read out ends.
+template <size_t BUFFER_SIZE = SAMPLE_HISTORY_RING_BUFFER_SIZE_BYTES,
+          size_t OVERFLOW_BUFFER_SIZE = SAMPLE_OVERFLOW_BUFFER_SIZE_BYTES>
 class SampleHistoryRingBuffer : protected ByteArray<BUFFER_SIZE> {
 public:
   void putSample(const Sample &sample) {
+    putRecord(sample.getDataArray().data());
+  };
+
+  // Stores sample size bytes from record, which may be larger than a Sample
+  void putRecord(const uint8_t *record) {
+    if (sizeInSamples() == 0) {
+      return;
+    }
+    if (mReadOutPinned && isFull() && mTail == mReadOutStartIndex &&
+        mReadOutStartIndex != mReadOutEndIndex) {
+      if (mOverflow.put(record)) {
+        return;
+      }
+      // the overflow buffer is full too, give up the pinned range
+      mReadOutInvalidated = true;
+      endReadOut();
+    }
     // iterate outSampleIndex if overwriting
     if (isFull()) {
       mTail = nextIndex(mTail);
     }
-    // copy byte wise
-    writeSample(sample);
+    memcpy(&this->mData[mHead * mSampleSizeBytes], record, mSampleSizeBytes);
 
     // iterate mHead
     mHead = nextIndex(mHead);
   };
 
-  void setSampleSize(const size_t sampleSize) {
+  // Samples of any size are stored, always true
+  bool setSampleSize(const size_t sampleSize) {
     mSampleSizeBytes = sampleSize;
+    mOverflow.setSampleSize(sampleSize);
     reset();
+    return true;
   };
 
   [[nodiscard]] uint32_t numberOfSamplesInHistory() const {
@@ -69,9 +100,14 @@ public:
   [[nodiscard]] bool isFull() const { return nextIndex(mHead) == mTail; };
 
   void startReadOut(const uint32_t nrOfSamples) {
+    mReadOutByteOffset = 0;
+    mReadOutPinned = true;
+    mReadOutInvalidated = false;
+    mReadOutEndIndex = mHead;
     // read out the whole sample buffer
     if (nrOfSamples >= numberOfSamplesInHistory()) {
       mSampleReadOutIndex = mTail;
+      mReadOutStartIndex = mSampleReadOutIndex;
       return;
     }
 
@@ -80,26 +116,132 @@ public:
       nextReadOutIndex += sizeInSamples();
     }
     mSampleReadOutIndex = static_cast<uint32_t>(nextReadOutIndex);
+    mReadOutStartIndex = mSampleReadOutIndex;
+  };
+
+  // Releases the pinned range and adds the samples held back meanwhile
+  void endReadOut() {
+    mReadOutPinned = false;
+    while (!mOverflow.isEmpty()) {
+      putRecord(mOverflow.front());
+      mOverflow.pop();
+    }
+  };
+
+  // True if the pinned range had to be overwritten since startReadOut
+  [[nodiscard]] bool readOutInvalidated() const {
+    return mReadOutInvalidated;
+  };
+
+  // Moves the read out to the given byte offset from the start of the range
+  // given to startReadOut, e.g. to send parts of a download again
+  void seekReadOut(const size_t byteOffset) {
+    if (mSampleSizeBytes == 0) {
+      return;
+    }
+    mSampleReadOutIndex =
+        (mReadOutStartIndex + byteOffset / mSampleSizeBytes) % sizeInSamples();
+    mReadOutByteOffset = byteOffset % mSampleSizeBytes;
+  };
+
+  // Number of samples left until the read out reaches the end of its range
+  [[nodiscard]] uint32_t numberOfSamplesToReadOut() const {
+    const uint32_t endIndex = readOutEndIndex();
+    if (endIndex >= mSampleReadOutIndex) {
+      return endIndex - mSampleReadOutIndex;
+    }
+    return sizeInSamples() - (mSampleReadOutIndex - endIndex);
+  };
+
+  // Reads out up to maxSamples samples without copying them. The samples are
+  // given as at most two spans into the history memory, the second one only
+  // being used if the read out wraps around the end of the buffer. The spans
+  // stay valid until the next call to putSample.
+  size_t readOutNextSamples(const size_t maxSamples, SampleSpan &first,
+                            SampleSpan &second) {
+    if (mSampleSizeBytes == 0) {
+      return 0;
+    }
+    return readOutNextBytes(maxSamples * mSampleSizeBytes, first, second) /
+           mSampleSizeBytes;
+  };
+
+  // Same as readOutNextSamples, but treats the read out range as a continuous
+  // byte stream that may be split within a sample.
+  size_t readOutNextBytes(const size_t maxBytes, SampleSpan &first,
+                          SampleSpan &second) {
+    size_t count =
+        numberOfSamplesToReadOut() * mSampleSizeBytes - mReadOutByteOffset;
+    if (count > maxBytes) {
+      count = maxBytes;
+    }
+    if (count == 0) {
+      first = SampleSpan{};
+      second = SampleSpan{};
+      return 0;
+    }
+    const size_t startByte =
+        mSampleReadOutIndex * mSampleSizeBytes + mReadOutByteOffset;
+    const size_t bytesUntilWrap =
+        sizeInSamples() * mSampleSizeBytes - startByte;
+    const size_t firstCount = count < bytesUntilWrap ? count : bytesUntilWrap;
+
+    first.data = &this->mData[startByte];
+    first.sizeBytes = firstCount;
+    second.data = this->mData.data();
+    second.sizeBytes = count - firstCount;
+
+    const size_t consumedBytes = mReadOutByteOffset + count;
+    mSampleReadOutIndex =
+        (mSampleReadOutIndex + consumedBytes / mSampleSizeBytes) %
+        sizeInSamples();
+    mReadOutByteOffset = consumedBytes % mSampleSizeBytes;
+    return count;
+  };
+
+  // Copies up to maxBytes of the read out range to destination
+  size_t readOutNextBytes(uint8_t *destination, const size_t maxBytes) {
+    SampleSpan first;
+    SampleSpan second;
+    const size_t count = readOutNextBytes(maxBytes, first, second);
+    if (count > 0) {
+      memcpy(destination, first.data, first.sizeBytes);
+      memcpy(&destination[first.sizeBytes], second.data, second.sizeBytes);
+    }
+    return count;
   };
 
-  // May give out an invalid sample if called on an empty sample history
-  Sample readOutNextSample(bool &allSamplesRead) {
-    const Sample sample = readSample(mSampleReadOutIndex);
-    if (!allSamplesRead) {
-      mSampleReadOutIndex = nextIndex(mSampleReadOutIndex);
+  // Copies up to maxSamples samples of the read out range to destination
+  size_t readOutNextSamples(uint8_t *destination, const size_t maxSamples) {
+    if (mSampleSizeBytes == 0) {
+      return 0;
     }
-    allSamplesRead = (mSampleReadOutIndex == mHead);
-    return sample;
+    return readOutNextBytes(destination, maxSamples * mSampleSizeBytes) /
+           mSampleSizeBytes;
   };
 
   void reset() {
     mHead = 0;
     mTail = 0;
     mSampleReadOutIndex = 0;
+    mReadOutStartIndex = 0;
+    mReadOutByteOffset = 0;
+    mReadOutEndIndex = 0;
+    mReadOutPinned = false;
+    mReadOutInvalidated = false;
+    mOverflow.reset();
   };
 
 private:
+  // The read out range ends with the latest sample unless it is pinned
+  [[nodiscard]] uint32_t readOutEndIndex() const {
+    return mReadOutPinned ? mReadOutEndIndex : mHead;
+  };
+
   [[nodiscard]] uint32_t nextIndex(const uint32_t index) const {
+    if (sizeInSamples() == 0) {
+      return 0;
+    }
     return (index + 1) % sizeInSamples();
   };
 
@@ -110,26 +252,17 @@ private:
     return (BUFFER_SIZE / mSampleSizeBytes);
   };
 
-  void writeSample(const Sample &sample) {
-    for (int byteIndex = 0; byteIndex < mSampleSizeBytes; ++byteIndex) {
-      this->mData[mHead * mSampleSizeBytes + byteIndex] =
-          sample.getByte(byteIndex);
-    }
-  };
-
-  [[nodiscard]] Sample readSample(const uint32_t sampleIndex) const {
-    Sample sample;
-    for (size_t i = 0; i < mSampleSizeBytes; ++i) {
-      const uint8_t byte = this->getByte((sampleIndex * mSampleSizeBytes) + i);
-      sample.setByte(byte, i);
-    }
-    return sample;
-  };
-
 private:
   uint32_t mHead = 0;
   uint32_t mTail = 0;
   uint32_t mSampleReadOutIndex = 0;
+  uint32_t mReadOutStartIndex = 0;
+  // bytes of the sample at mSampleReadOutIndex that are already read out
+  size_t mReadOutByteOffset = 0;
+  uint32_t mReadOutEndIndex = 0;
+  bool mReadOutPinned = false;
+  bool mReadOutInvalidated = false;
+  SampleOverflowBuffer<OVERFLOW_BUFFER_SIZE> mOverflow;
 
   size_t mSampleSizeBytes = 0;
 };
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SAMPLE_HISTORY_TIER
+#define SAMPLE_HISTORY_TIER
+
+#include "SampleHistoryRingBuffer.h"
+
+namespace sensirion::upt::ble_server {
+
+// Number of min, mean and max values stored per aggregated sample
+static constexpr size_t HISTORY_TIER_VALUES_PER_RECORD = 3;
+
+// Coarse history that aggregates a number of samples into one record holding
+// the minimum, mean and maximum of every 16 bit value of the sample. A record
+// is laid out as [min sample][mean sample][max sample].
+template <size_t BUFFER_SIZE> class SampleHistoryTier {
+public:
+  void setSampleSize(const size_t sampleSize) {
+    mSampleSizeBytes = sampleSize;
+    mHistory.setSampleSize(recordSizeBytes());
+    reset();
+  };
+
+  // Values whose bit is set in the mask (bit n for the value at byte offset
+  // 2n) are compared and averaged as signed 16 bit integers
+  void setSignedValues(const uint16_t signedMask) {
+    mSignedMask = signedMask;
+    clearAggregate();
+  };
+
+  void setSamplesPerRecord(const uint16_t samplesPerRecord) {
+    mSamplesPerRecord = samplesPerRecord > 0 ? samplesPerRecord : 1;
+    clearAggregate();
+  };
+
+  [[nodiscard]] size_t recordSizeBytes() const {
+    return mSampleSizeBytes * HISTORY_TIER_VALUES_PER_RECORD;
+  };
+
+  // Returns true if the sample completed a record
+  bool addSample(const uint8_t *sample) {
+    return addAggregate(sample, sample, sample);
+  };
+
+  // Adds an already aggregated sample, e.g. a record of a finer tier.
+  // Returns true if it completed a record.
+  bool addAggregate(const uint8_t *min, const uint8_t *mean,
+                    const uint8_t *max) {
+    for (size_t i = 0; i < numberOfValues(); ++i) {
+      const int32_t minValue = readValue(min, i);
+      const int32_t maxValue = readValue(max, i);
+      if (mCount == 0 || minValue < mMin[i]) {
+        mMin[i] = minValue;
+      }
+      if (mCount == 0 || maxValue > mMax[i]) {
+        mMax[i] = maxValue;
+      }
+      mSum[i] += readValue(mean, i);
+    }
+    if (mSampleSizeBytes % 2 != 0) {
+      // a trailing byte that is no 16 bit value keeps its latest value
+      mTrailingByte = mean[mSampleSizeBytes - 1];
+    }
+    if (++mCount < mSamplesPerRecord) {
+      return false;
+    }
+    writeRecord();
+    mHistory.putRecord(mRecord.data());
+    clearAggregate();
+    return true;
+  };
+
+  // The latest completed record
+  [[nodiscard]] const uint8_t *latestRecord() const { return mRecord.data(); };
+
+  [[nodiscard]] uint32_t numberOfSamplesInHistory() const {
+    return mHistory.numberOfSamplesInHistory();
+  };
+
+  void startReadOut(const uint32_t nrOfRecords) {
+    mHistory.startReadOut(nrOfRecords);
+  };
+
+  void endReadOut() { mHistory.endReadOut(); };
+
+  [[nodiscard]] bool readOutInvalidated() const {
+    return mHistory.readOutInvalidated();
+  };
+
+  void seekReadOut(const size_t byteOffset) {
+    mHistory.seekReadOut(byteOffset);
+  };
+
+  size_t readOutNextBytes(uint8_t *destination, const size_t maxBytes) {
+    return mHistory.readOutNextBytes(destination, maxBytes);
+  };
+
+  size_t readOutNextSamples(uint8_t *destination, const size_t maxRecords) {
+    return mHistory.readOutNextSamples(destination, maxRecords);
+  };
+
+  void reset() {
+    mHistory.reset();
+    clearAggregate();
+  };
+
+private:
+  static constexpr size_t MAX_VALUES = MAX_SAMPLE_SIZE_BYTES / 2;
+
+  [[nodiscard]] size_t numberOfValues() const {
+    return mSampleSizeBytes / 2 < MAX_VALUES ? mSampleSizeBytes / 2
+                                             : MAX_VALUES;
+  };
+
+  [[nodiscard]] int32_t readValue(const uint8_t *sample,
+                                  const size_t index) const {
+    const uint16_t value =
+        sample[2 * index] | static_cast<uint16_t>(sample[2 * index + 1] << 8);
+    if (mSignedMask & (1 << index)) {
+      return static_cast<int16_t>(value);
+    }
+    return value;
+  };
+
+  void writeValue(const int32_t value, const size_t position) {
+    mRecord[position] = static_cast<uint8_t>(value);
+    mRecord[position + 1] = static_cast<uint8_t>(value >> 8);
+  };
+
+  void writeRecord() {
+    const size_t meanOffset = mSampleSizeBytes;
+    const size_t maxOffset = 2 * mSampleSizeBytes;
+    for (size_t i = 0; i < numberOfValues(); ++i) {
+      // round the mean to the nearest integer
+      const int64_t halfCount = mCount / 2;
+      const int64_t sum = mSum[i] >= 0 ? mSum[i] + halfCount
+                                       : mSum[i] - halfCount;
+      writeValue(mMin[i], 2 * i);
+      writeValue(static_cast<int32_t>(sum / mCount), meanOffset + 2 * i);
+      writeValue(mMax[i], maxOffset + 2 * i);
+    }
+    if (mSampleSizeBytes % 2 != 0) {
+      mRecord[meanOffset - 1] = mTrailingByte;
+      mRecord[maxOffset - 1] = mTrailingByte;
+      mRecord[recordSizeBytes() - 1] = mTrailingByte;
+    }
+  };
+
+  void clearAggregate() {
+    mCount = 0;
+    mSum.fill(0);
+  };
+
+private:
+  SampleHistoryRingBuffer<BUFFER_SIZE> mHistory;
+  std::array<uint8_t,
+             MAX_SAMPLE_SIZE_BYTES * HISTORY_TIER_VALUES_PER_RECORD>
+      mRecord = {};
+  std::array<int32_t, MAX_VALUES> mMin = {};
+  std::array<int32_t, MAX_VALUES> mMax = {};
+  std::array<int64_t, MAX_VALUES> mSum = {};
+  uint8_t mTrailingByte = 0;
+  uint16_t mCount = 0;
+  uint16_t mSamplesPerRecord = 1;
+  uint16_t mSignedMask = 0;
+  size_t mSampleSizeBytes = 0;
+};
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* SAMPLE_HISTORY_TIER */
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SAMPLE_OVERFLOW_BUFFER_H
+#define SAMPLE_OVERFLOW_BUFFER_H
+
+#include "ByteArray.h"
+
+#include <cstring>
+
+namespace sensirion::upt::ble_server {
+
+static constexpr size_t SAMPLE_OVERFLOW_BUFFER_SIZE_BYTES = 360;
+
+// Holds samples a history can not store while its read out range is pinned,
+// oldest first, until they are moved into the history
+template <size_t BUFFER_SIZE = SAMPLE_OVERFLOW_BUFFER_SIZE_BYTES>
+class SampleOverflowBuffer : protected ByteArray<BUFFER_SIZE> {
+public:
+  void setSampleSize(const size_t sampleSize) {
+    mSampleSizeBytes = sampleSize;
+    reset();
+  };
+
+  // Returns false if the buffer is full
+  bool put(const uint8_t *record) {
+    if (isFull()) {
+      return false;
+    }
+    const size_t index = (mFront + mCount) % capacity();
+    memcpy(&this->mData[index * mSampleSizeBytes], record, mSampleSizeBytes);
+    ++mCount;
+    return true;
+  };
+
+  [[nodiscard]] bool isEmpty() const { return mCount == 0; };
+
+  [[nodiscard]] bool isFull() const { return mCount >= capacity(); };
+
+  // The oldest sample, only valid if the buffer is not empty
+  [[nodiscard]] const uint8_t *front() const {
+    return &this->mData[mFront * mSampleSizeBytes];
+  };
+
+  void pop() {
+    if (mCount == 0) {
+      return;
+    }
+    mFront = (mFront + 1) % capacity();
+    --mCount;
+  };
+
+  void reset() {
+    mFront = 0;
+    mCount = 0;
+  };
+
+private:
+  [[nodiscard]] size_t capacity() const {
+    if (mSampleSizeBytes == 0) {
+      return 0;
+    }
+    return BUFFER_SIZE / mSampleSizeBytes;
+  };
+
+private:
+  size_t mFront = 0;
+  size_t mCount = 0;
+  size_t mSampleSizeBytes = 0;
+};
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* SAMPLE_OVERFLOW_BUFFER_H */
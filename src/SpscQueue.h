@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace sensirion::upt::ble_server {
+
+// Lock-free queue for handing items from one task to another. push must only
+// be called from a single producer task and pop from a single consumer task
+// at a time; both never block.
+template <typename T, size_t CAPACITY> class SpscQueue {
+  static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0,
+                "capacity must be a power of two");
+
+public:
+  // Returns false if the queue is full
+  bool push(const T &item) {
+    const uint32_t head = mHead.load(std::memory_order_relaxed);
+    if (head - mTail.load(std::memory_order_acquire) >= CAPACITY) {
+      return false;
+    }
+    mItems[head & (CAPACITY - 1)] = item;
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+  };
+
+  // Returns false if the queue is empty
+  bool pop(T &item) {
+    const uint32_t tail = mTail.load(std::memory_order_relaxed);
+    if (mHead.load(std::memory_order_acquire) == tail) {
+      return false;
+    }
+    item = mItems[tail & (CAPACITY - 1)];
+    mTail.store(tail + 1, std::memory_order_release);
+    return true;
+  };
+
+private:
+  std::array<T, CAPACITY> mItems = {};
+  // free running counters, masked to get the position in mItems
+  std::atomic<uint32_t> mHead{0};
+  std::atomic<uint32_t> mTail{0};
+};
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* SPSC_QUEUE_H */
@@ -1,6 +1,8 @@
 #include "UptBleServer.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 
 namespace sensirion::upt::ble_server {
 
@@ -26,18 +28,65 @@ void UptBleServer::writeValueToCurrentSample(
     return;
   }
 
+  const auto index = static_cast<size_t>(signalType);
+  if (index >= mSignalSlots.size()) {
+    return;
+  }
+  const SignalSlot &slot = mSignalSlots[index];
   // Check for the correct signal type
-  if (mSampleConfig.sampleSlots.count(signalType) == 0) {
+  if (!slot.encodingFunction) {
     // implies signal type is not part of the sample
     return;
   }
 
-  // Get offset and converted value from the sample configuration
-  const uint16_t convertedValue =
-      mSampleConfig.sampleSlots.at(signalType).encodingFunction(value);
-  const size_t offset = mSampleConfig.sampleSlots.at(signalType).offset;
+  mCurrentSample.writeValue(slot.encodingFunction(value), slot.offset);
+  mDownloadBleService.writeValue(value, slot.offset);
+}
+
+void UptBleServer::writeValuesToCurrentSample(
+    const std::initializer_list<SignalValue> values) {
+  writeValuesToCurrentSample(values.begin(), values.size());
+}
+
+void UptBleServer::writeValuesToCurrentSample(const SignalValue *values,
+                                              const size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    writeValueToCurrentSample(values[i].value, values[i].signalType);
+  }
+}
+
+size_t UptBleServer::importSamples(const SignalColumn *columns,
+                                   const size_t columnCount,
+                                   const size_t sampleCount) {
+  const size_t sampleSize = mSampleConfig.sampleSizeBytes;
+  std::array<uint8_t, IMPORT_BATCH_SIZE * MAX_SAMPLE_SIZE_BYTES> records;
+  // each batch continues from the latest sample of the batch before
+  Sample previous = mCurrentSample;
+  for (size_t first = 0; first < sampleCount; first += IMPORT_BATCH_SIZE) {
+    const size_t count = std::min(IMPORT_BATCH_SIZE, sampleCount - first);
+    for (size_t i = 0; i < count; ++i) {
+      memcpy(&records[i * sampleSize], previous.getDataArray().data(),
+             sampleSize);
+    }
+    for (size_t column = 0; column < columnCount; ++column) {
+      mBatchEncoder.encodeColumn(columns[column].signalType,
+                                 &columns[column].values[first], count,
+                                 records.data(), sampleSize);
+    }
+    const size_t queued =
+        mDownloadBleService.importSamples(records.data(), count);
+    if (queued < count) {
+      return first + queued;
+    }
+    previous.setData(&records[(count - 1) * sampleSize], sampleSize);
+  }
+  return sampleCount;
+}
 
-  mCurrentSample.writeValue(convertedValue, offset);
+size_t UptBleServer::importSamples(
+    const std::initializer_list<SignalColumn> columns,
+    const size_t sampleCount) {
+  return importSamples(columns.begin(), columns.size(), sampleCount);
 }
 
 void UptBleServer::commitSample() {
@@ -47,6 +96,63 @@ void UptBleServer::commitSample() {
 
 void UptBleServer::handleDownload() { mDownloadBleService.handleDownload(); }
 
+uint32_t UptBleServer::getNumberOfDroppedSamples() const {
+  return mDownloadBleService.numberOfDroppedSamples();
+}
+
+uint32_t UptBleServer::getNumberOfDroppedRequests() const {
+  return mDownloadBleService.numberOfDroppedCommands();
+}
+
+void UptBleServer::setDownloadBurst(const uint16_t maxPackets,
+                                    const uint32_t timeBudgetMs) {
+  mDownloadBleService.setDownloadBurst(maxPackets, timeBudgetMs);
+}
+
+void UptBleServer::setDownloadTransmitMode(const TransmitMode mode) {
+  mDownloadBleService.setDownloadTransmitMode(mode);
+}
+
+void UptBleServer::setDownloadAckWindow(const uint16_t windowSize) {
+  mDownloadBleService.setDownloadAckWindow(windowSize);
+}
+
+bool UptBleServer::setAdaptiveConnectionParameters(
+    const ConnectionParameters &download, const ConnectionParameters &idle) {
+  return mDownloadBleService.setAdaptiveConnectionParameters(download, idle);
+}
+
+void UptBleServer::setAdvertisementChangeFilter(const bool enable,
+                                                const uint32_t maxStalenessMs) {
+  mBleAdvertisement.setChangeFilter(enable, maxStalenessMs);
+}
+
+void UptBleServer::setAdvertisementDeadband(const core::SignalType signalType,
+                                            const float deadband) {
+  mBleAdvertisement.setDeadband(signalType, deadband);
+}
+
+void UptBleServer::setHistoryAggregation(const AggregationMode mode) {
+  mDownloadBleService.setAggregationMode(mode);
+}
+
+void UptBleServer::setHistoryTierFactors(const uint16_t tier1Factor,
+                                         const uint16_t tier2Factor) {
+  mDownloadBleService.setHistoryTierFactors(tier1Factor, tier2Factor);
+}
+
+void UptBleServer::setEventDrivenDownload(const bool enable) {
+  mDownloadBleService.setEventDrivenDownload(enable);
+}
+
+void UptBleServer::setPackedDownload(const bool packed) {
+  mDownloadBleService.setPackedDownload(packed);
+}
+
+void UptBleServer::setMaxDownloadPacketSize(const size_t size) {
+  mDownloadBleService.setMaxDownloadPacketSize(size);
+}
+
 bool UptBleServer::hasConnectedDevices() const {
   return mBleLibrary.hasConnectedDevices();
 }
@@ -60,9 +166,46 @@ void UptBleServer::registerBleServiceProvider(
 }
 
 void UptBleServer::setSampleConfig(const core::DataType dataType) {
-  mSampleConfig = core::GetSampleConfiguration(dataType);
+  setSampleConfig(core::GetSampleConfiguration(dataType));
+}
+
+bool UptBleServer::setSampleConfig(const core::SampleConfig &sampleConfig) {
+  if (sampleConfig.sampleSizeBytes > MAX_SAMPLE_SIZE_BYTES) {
+    return false;
+  }
+  // the samples of a download packet must fit it, a single sample larger
+  // than a packet is sent as a byte stream spanning packets
+  const size_t countPerPacket = sampleConfig.sampleCountPerPacket;
+  if (countPerPacket == 0 ||
+      (countPerPacket > 1 && countPerPacket * sampleConfig.sampleSizeBytes >
+                                 DOWNLOAD_PACKET_PAYLOAD_SIZE_BYTES)) {
+    return false;
+  }
+  for (const auto &[signalType, slot] : sampleConfig.sampleSlots) {
+    if (slot.offset + 2 > sampleConfig.sampleSizeBytes) {
+      return false;
+    }
+  }
+  // a history built for a fixed sample size rejects other sizes
+  if (!mDownloadBleService.setSampleConfig(sampleConfig)) {
+    return false;
+  }
+  mSampleConfig = sampleConfig;
+  resolveSignalSlots();
   mBleAdvertisement.setSampleConfig(mSampleConfig);
-  mDownloadBleService.setSampleConfig(mSampleConfig);
+  return true;
+}
+
+void UptBleServer::resolveSignalSlots() {
+  mBatchEncoder.setSampleConfig(mSampleConfig);
+  mSignalSlots = {};
+  for (const auto &[signalType, slot] : mSampleConfig.sampleSlots) {
+    const auto index = static_cast<size_t>(signalType);
+    if (index < mSignalSlots.size()) {
+      mSignalSlots[index].encodingFunction = slot.encodingFunction;
+      mSignalSlots[index].offset = slot.offset;
+    }
+  }
 }
 
 String UptBleServer::getDeviceIdString() const {
@@ -80,28 +223,44 @@ void UptBleServer::setupBLEInfrastructure() {
   mBleLibrary.setProviderCallbacks(this);
 }
 
-void UptBleServer::onConnect() {
-  mDownloadBleService.onConnect();
+void UptBleServer::onConnect(const ConnectionHandle connection) {
+  mDownloadBleService.onConnect(connection);
 
   for (IBleServiceProvider *provider : mBleServiceProviders) {
-    provider->onConnect();
+    provider->onConnect(connection);
   }
 }
 
-void UptBleServer::onDisconnect() {
-  mDownloadBleService.onDisconnect();
+void UptBleServer::onDisconnect(const ConnectionHandle connection) {
+  mDownloadBleService.onDisconnect(connection);
 
   for (IBleServiceProvider *provider : mBleServiceProviders) {
-    provider->onDisconnect();
+    provider->onDisconnect(connection);
   }
 }
 
-void UptBleServer::onSubscribe(const std::string &uuid,
+void UptBleServer::onSubscribe(const ConnectionHandle connection,
+                               const std::string &uuid,
                                const uint16_t subValue) {
-  mDownloadBleService.onSubscribe(uuid, subValue);
+  mDownloadBleService.onSubscribe(connection, uuid, subValue);
+
+  for (IBleServiceProvider *provider : mBleServiceProviders) {
+    provider->onSubscribe(connection, uuid, subValue);
+  }
+}
+
+void UptBleServer::onNotifyStatus(const std::string &uuid, const bool success) {
+  mDownloadBleService.onNotifyStatus(uuid, success);
+
+  for (IBleServiceProvider *provider : mBleServiceProviders) {
+    provider->onNotifyStatus(uuid, success);
+  }
+}
 
+void UptBleServer::onLinkUpdate(const ConnectionHandle connection,
+                                const LinkInfo &info) {
   for (IBleServiceProvider *provider : mBleServiceProviders) {
-    provider->onSubscribe(uuid, subValue);
+    provider->onLinkUpdate(connection, info);
   }
 }
 
@@ -36,12 +36,31 @@
 #include "IBleLibraryWrapper.h"
 #include "IBleServiceProvider.h"
 #include "IProviderCallbacks.h"
+#include "SampleBatchEncoder.h"
 #include "Sensirion_UPT_Core.h"
 
+#include <array>
+#include <initializer_list>
 #include <string>
 
 namespace sensirion::upt::ble_server {
 
+/**
+ * @brief A value of a signal, to write several values at once.
+ */
+struct SignalValue {
+  core::SignalType signalType;
+  float value;
+};
+
+/**
+ * @brief The values of a signal for a series of samples, oldest first.
+ */
+struct SignalColumn {
+  core::SignalType signalType;
+  const float *values;
+};
+
 /**
  * @brief High-level BLE server for Sensirion UPT gadgets.
  *
@@ -65,7 +84,9 @@ public:
       : mBleLibrary{libraryWrapper},
         mSampleConfig{core::GetSampleConfiguration(dataType)},
         mDownloadBleService{mBleLibrary, mSampleConfig},
-        mBleAdvertisement{mBleLibrary, mSampleConfig} {};
+        mBleAdvertisement{mBleLibrary, mSampleConfig} {
+    resolveSignalSlots();
+  };
 
   // Don't allow copy of UptBleServer
   UptBleServer& operator=(const UptBleServer&&) = delete;
@@ -114,6 +135,25 @@ public:
    */
   void setSampleConfig(core::DataType dataType);
 
+  /**
+   * @brief Set a sample configuration, e.g. one extended by further slots.
+   *
+   * Samples may be up to MAX_SAMPLE_SIZE_BYTES long, set with the
+   * `BLE_SERVER_MAX_SAMPLE_SIZE_BYTES` build flag (default 20 bytes). The
+   * advertisement carries the first ADVERTISED_SAMPLE_SIZE_BYTES (12) of
+   * each sample, signals in slots beyond are only part of the download
+   * history.
+   *
+   * @param sampleConfig Sample configuration to apply.
+   * @return false if the sample or one of its slots does not fit, or the
+   *         configured samples per packet do not fit a 20 byte download
+   *         packet (one larger sample per packet is allowed), or the
+   *         history is built for another size with
+   *         `BLE_SERVER_HISTORY_SAMPLE_SIZE`. The configuration is left
+   *         unchanged then.
+   */
+  bool setSampleConfig(const core::SampleConfig &sampleConfig);
+
   /**
    * @brief Write a single signal value into the current sample buffer.
    *
@@ -125,11 +165,79 @@ public:
    */
   void writeValueToCurrentSample(float value, core::SignalType signalType);
 
+  /**
+   * @brief Write the values of a whole measurement into the current sample
+   *        buffer.
+   *
+   * Same as calling writeValueToCurrentSample for each value, e.g.
+   * `writeValuesToCurrentSample({{core::SignalType::CO2_PARTS_PER_MILLION,
+   * co2}, {core::SignalType::VOC_INDEX, vocIndex}})`.
+   *
+   * @param values Signal types and values to write.
+   */
+  void writeValuesToCurrentSample(std::initializer_list<SignalValue> values);
+
+  /**
+   * @brief Write count values into the current sample buffer.
+   *
+   * @param values Signal types and values to write.
+   * @param count Number of values.
+   */
+  void writeValuesToCurrentSample(const SignalValue *values, size_t count);
+
+  /**
+   * @brief Import a series of samples into the download history.
+   *
+   * Meant to restore a history at boot, e.g. from flash or from a sensor's
+   * own data logger. Each column holds sampleCount values of one signal,
+   * sample i is built from the i-th value of every column, the last sample
+   * is stored as the latest one. The samples go into the history as they
+   * are, one per history interval, without aggregation.
+   *
+   * The values are encoded a column at a time. Affine encodings are found
+   * once per sample config and run as a branch free loop the compiler
+   * vectorizes. Values right at a rounding step or outside the probed
+   * range are encoded by the encoding function, so the encoded values are
+   * the ones writeValueToCurrentSample writes. Other encodings call the
+   * encoding function per value.
+   *
+   * NaN values keep the value of the sample before, signals without a
+   * column keep the value of the current sample. Signal types that are not
+   * part of the sample are ignored.
+   *
+   * The samples are queued and stored by handleDownload. A call imports at
+   * most as many samples as the sample queue holds (see
+   * BLE_SERVER_SAMPLE_QUEUE_SIZE); import the rest after handleDownload ran.
+   *
+   * @param columns Values per signal type.
+   * @param columnCount Number of columns.
+   * @param sampleCount Number of values per column.
+   * @return Number of imported samples, from the start of the columns.
+   */
+  size_t importSamples(const SignalColumn *columns, size_t columnCount,
+                       size_t sampleCount);
+
+  /**
+   * @brief Import a series of samples into the download history.
+   *
+   * @param columns Values per signal type.
+   * @param sampleCount Number of values per column.
+   * @return Number of imported samples, from the start of the columns.
+   */
+  size_t importSamples(std::initializer_list<SignalColumn> columns,
+                       size_t sampleCount);
+
   /**
    * @brief Finalize and publish the current sample.
    *
    * Commits the buffered sample to advertisement and download services and
    * prepares the buffer for the next sample.
+   *
+   * Writing and committing samples may run on a different task (and core)
+   * than handleDownload. Samples and BLE requests are handed over through
+   * lock-free queues, so neither side blocks the other. History samples are
+   * stored by the next handleDownload; samples committed while the queue is
+   * full are dropped, see getNumberOfDroppedSamples.
    */
   void commitSample();
 
@@ -137,9 +245,172 @@ public:
    * @brief Handle pending download requests.
    *
    * Call this periodically from the main loop to service download operations.
+   * It also stores the committed history samples and applies the requests of
+   * the centrals, so call it at least once per
+   * BLE_SERVER_SAMPLE_QUEUE_SIZE history intervals.
    */
   void handleDownload();
 
+  /**
+   * @brief Number of history samples dropped because handleDownload did not
+   * store them in time.
+   */
+  [[nodiscard]] uint32_t getNumberOfDroppedSamples() const;
+
+  /**
+   * @brief Number of download requests of centrals dropped because
+   * handleDownload did not apply them in time.
+   *
+   * Size the queue with BLE_SERVER_DOWNLOAD_COMMAND_QUEUE_SIZE.
+   */
+  [[nodiscard]] uint32_t getNumberOfDroppedRequests() const;
+
+  /**
+   * @brief Configure how many download packets a handleDownload call sends.
+   *
+   * By default a single packet is sent per call. With a burst, each call
+   * keeps sending packets until maxPackets are sent, the time budget is used
+   * up or the BLE stack cannot queue more packets. Packets that could not be
+   * queued are sent on the next call.
+   *
+   * @param maxPackets maximal number of packets per call
+   * @param timeBudgetMs maximal time spent per call in ms, 0 for no limit
+   */
+  void setDownloadBurst(uint16_t maxPackets, uint32_t timeBudgetMs = 0);
+
+  /**
+   * @brief Select how download packets are sent.
+   *
+   * Indications (default) are confirmed by the central before the next packet
+   * can be sent. Notifications are not confirmed and allow several packets
+   * per connection interval; combine them with setDownloadAckWindow to let
+   * the client detect and recover lost packets.
+   *
+   * @param mode indication or notification
+   */
+  void setDownloadTransmitMode(TransmitMode mode);
+
+  /**
+   * @brief Require the client to acknowledge download packets.
+   *
+   * The client writes the next expected sequence number (uint16, little
+   * endian) to the download ack characteristic. At most windowSize packets
+   * are sent ahead of the acknowledged sequence number. An optional third
+   * byte set to 1 requests the packets from that sequence number again. The
+   * download completes once all packets are acknowledged. The download
+   * header announces the mode, which applies from the next download on.
+   *
+   * @param windowSize number of unacknowledged packets, 0 to disable
+   */
+  void setDownloadAckWindow(uint16_t windowSize);
+
+  /**
+   * @brief Adapt the connection parameters to the download activity.
+   *
+   * The download parameters, typically the shortest interval without
+   * latency, are requested for a central when its download starts. The idle
+   * parameters, typically a long interval with latency to save power, are
+   * requested on connect and when the download completes. Without this, all
+   * connections keep the preferred parameters.
+   *
+   * @param download parameters while downloading
+   * @param idle parameters while not downloading
+   * @return false if the idle parameters are out of the allowed ranges,
+   *         nothing is changed then.
+   */
+  bool setAdaptiveConnectionParameters(const ConnectionParameters &download,
+                                       const ConnectionParameters &idle);
+
+  /**
+   * @brief Advance downloads from BLE events instead of only from polling.
+   *
+   * When enabled, the next download packets are sent as soon as the BLE
+   * stack reports the previous one as completed, when a download is
+   * requested and when the client acknowledges packets. This runs on the BLE
+   * stack's task. Indications and acknowledged downloads are driven entirely
+   * by these events; with unacknowledged notifications the stack gives no
+   * event once its transmit queue drains, so keep calling handleDownload.
+   *
+   * @param enable true to send packets from BLE events
+   */
+  void setEventDrivenDownload(bool enable);
+
+  /**
+   * @brief Enable packed downloads.
+   *
+   * In packed mode the history is sent as a continuous byte stream, so samples
+   * may be split across two download packets and every packet is filled
+   * completely. The download header announces the mode to the client. The
+   * setting applies from the next download on.
+   *
+   * @param packed true to pack samples across packet boundaries
+   */
+  void setPackedDownload(bool packed);
+
+  /**
+   * @brief Allow download packets larger than the default 20 bytes.
+   *
+   * At the start of a download the packet size is chosen to fit the MTU
+   * negotiated with the central, limited by the given size. Each packet is
+   * filled with as many samples as fit and the download header announces the
+   * packet size to the client. The default of 20 bytes keeps the packet
+   * layout expected by clients unaware of larger packets.
+   *
+   * @param size maximal packet size in bytes (20 to 244)
+   */
+  void setMaxDownloadPacketSize(size_t size);
+
+  /**
+   * @brief Set the aggregation factors of the coarse history tiers.
+   *
+   * Besides the history of samples, tier 1 stores the minimum, mean and
+   * maximum of every tier1Factor samples and tier 2 the same of every
+   * tier2Factor tier 1 records. The defaults of 6 and 24 give hourly and
+   * daily records for the default history interval of 10 minutes. The tiers
+   * are enabled by setting BLE_SERVER_HISTORY_TIER_1_BUFFER_SIZE and
+   * BLE_SERVER_HISTORY_TIER_2_BUFFER_SIZE at build time. A client selects
+   * the tier with a fifth byte in the requested samples write.
+   *
+   * @param tier1Factor number of samples per tier 1 record
+   * @param tier2Factor number of tier 1 records per tier 2 record
+   */
+  void setHistoryTierFactors(uint16_t tier1Factor, uint16_t tier2Factor);
+
+  /**
+   * @brief Only update the advertisement if a value changed.
+   *
+   * With the filter enabled, a committed sample is advertised if a value
+   * differs from the advertised one by more than the deadband of its signal
+   * or if the advertised sample is older than maxStalenessMs. The history
+   * stores every committed sample regardless.
+   *
+   * @param enable true to enable the filter
+   * @param maxStalenessMs time after which a sample is advertised anyway
+   */
+  void setAdvertisementChangeFilter(bool enable,
+                                    uint32_t maxStalenessMs = 60000);
+
+  /**
+   * @brief Set the deadband of a signal for the advertisement change filter.
+   *
+   * @param signalType the signal
+   * @param deadband largest change that is not advertised, in the unit of
+   *        the values given to writeValueToCurrentSample
+   */
+  void setAdvertisementDeadband(core::SignalType signalType, float deadband);
+
+  /**
+   * @brief Select how committed samples are combined into the history.
+   *
+   * Every value written with writeValueToCurrentSample is taken into account
+   * on each commit and the history stores the mean (default), minimum or
+   * maximum over the history interval, encoded like the written values.
+   * LATEST stores the values of the last commit of the interval as before.
+   *
+   * @param mode aggregation of the values within a history interval
+   */
+  void setHistoryAggregation(AggregationMode mode);
+
   /**
    * @brief Register an additional BLE service provider.
    *
@@ -152,10 +423,21 @@ public:
   void registerBleServiceProvider(IBleServiceProvider &serviceProvider);
 
 private:
+  // Sample slot of a signal type, resolved from the sample config
+  struct SignalSlot {
+    std::function<uint16_t(float)> encodingFunction; // empty if not sampled
+    size_t offset = 0;
+  };
+
+  // Samples imported per batch, encoded on the stack
+  static constexpr size_t IMPORT_BATCH_SIZE = 32;
+
   IBleLibraryWrapper &mBleLibrary;
 
   core::SampleConfig mSampleConfig;
+  std::array<SignalSlot, NUMBER_OF_SIGNAL_TYPES> mSignalSlots;
   Sample mCurrentSample;
+  SampleBatchEncoder mBatchEncoder;
 
   DownloadBleService mDownloadBleService;
   BleAdvertisement mBleAdvertisement;
@@ -164,13 +446,21 @@ private:
 private:
   void setupBLEInfrastructure();
 
+  // Fills the slot tables from the sample config
+  void resolveSignalSlots();
+
 private:
   // ProviderCallbacks
-  void onConnect() override;
+  void onConnect(ConnectionHandle connection) override;
+
+  void onDisconnect(ConnectionHandle connection) override;
+
+  void onSubscribe(ConnectionHandle connection, const std::string &uuid,
+                   uint16_t subValue) override;
 
-  void onDisconnect() override;
+  void onNotifyStatus(const std::string &uuid, bool success) override;
 
-  void onSubscribe(const std::string &uuid, uint16_t subValue) override;
+  void onLinkUpdate(ConnectionHandle connection, const LinkInfo &info) override;
 };
 
 } // namespace sensirion::upt::ble_server
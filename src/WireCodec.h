@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2022, Sensirion AG
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Sensirion AG nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef WIRE_CODEC_H
+#define WIRE_CODEC_H
+
+#include "ByteArray.h"
+#include "IBleServiceLibrary.h"
+
+#include <type_traits>
+
+namespace sensirion::upt::ble_server {
+
+// Maps messages with a fixed layout to and from little endian wire bytes. A
+// message is a struct holding the byte size of its layout in WIRE_SIZE and a
+// static fields function visiting its integer members in wire order. An
+// optional MIN_WIRE_SIZE allows trailing fields to be left out by the
+// sender, they then keep their default value.
+//
+//   struct SamplesRequest {
+//     static constexpr size_t WIRE_SIZE = 5;
+//     static constexpr size_t MIN_WIRE_SIZE = 4;
+//     uint32_t numberOfSamples = 0;
+//     uint8_t tier = 0;
+//
+//     template <typename Self, typename Visitor>
+//     static constexpr void fields(Self &self, Visitor &visit) {
+//       visit(self.numberOfSamples);
+//       visit(self.tier);
+//     }
+//   };
+
+namespace wire {
+
+template <typename T> constexpr T readLittleEndian(const uint8_t *data) {
+  static_assert(std::is_integral_v<T>, "wire fields must be integers");
+  using Unsigned = std::make_unsigned_t<T>;
+  Unsigned value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    value |= static_cast<Unsigned>(static_cast<Unsigned>(data[i]) << (8 * i));
+  }
+  return static_cast<T>(value);
+}
+
+template <typename T>
+constexpr void writeLittleEndian(const T value, uint8_t *data) {
+  static_assert(std::is_integral_v<T>, "wire fields must be integers");
+  const auto unsignedValue = static_cast<std::make_unsigned_t<T>>(value);
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    data[i] = static_cast<uint8_t>(unsignedValue >> (8 * i));
+  }
+}
+
+struct SizeCounter {
+  size_t size = 0;
+
+  template <typename T> constexpr void operator()(const T &) {
+    size += sizeof(T);
+  }
+};
+
+struct Decoder {
+  const uint8_t *data;
+  size_t size;
+  size_t position = 0;
+
+  template <typename T> constexpr void operator()(T &field) {
+    // a missing trailing field keeps its default value
+    if (position + sizeof(T) <= size) {
+      field = readLittleEndian<T>(&data[position]);
+    }
+    position += sizeof(T);
+  }
+};
+
+struct Encoder {
+  uint8_t *data;
+  size_t position = 0;
+
+  template <typename T> constexpr void operator()(const T &field) {
+    writeLittleEndian(field, &data[position]);
+    position += sizeof(T);
+  }
+};
+
+template <typename Message> constexpr size_t fieldsSize() {
+  Message message{};
+  SizeCounter counter;
+  Message::fields(message, counter);
+  return counter.size;
+}
+
+template <typename Message, typename = void>
+struct MinWireSize : std::integral_constant<size_t, Message::WIRE_SIZE> {};
+
+template <typename Message>
+struct MinWireSize<Message, std::void_t<decltype(Message::MIN_WIRE_SIZE)>>
+    : std::integral_constant<size_t, Message::MIN_WIRE_SIZE> {};
+
+template <typename Message> constexpr void checkLayout() {
+  static_assert(fieldsSize<Message>() == Message::WIRE_SIZE,
+                "message fields do not add up to WIRE_SIZE");
+  static_assert(MinWireSize<Message>::value <= Message::WIRE_SIZE,
+                "MIN_WIRE_SIZE exceeds WIRE_SIZE");
+}
+
+} // namespace wire
+
+// Decodes a message straight from the received bytes, returns false if
+// fewer bytes than required were received
+template <typename Message>
+bool decodeMessage(const uint8_t *data, const size_t size, Message &message) {
+  wire::checkLayout<Message>();
+  if (data == nullptr || size < wire::MinWireSize<Message>::value) {
+    return false;
+  }
+  wire::Decoder decoder{data, size};
+  Message::fields(message, decoder);
+  return true;
+}
+
+template <typename Message>
+bool decodeMessage(const ByteView value, Message &message) {
+  return decodeMessage(value.data, value.size, message);
+}
+
+// The wire bytes of a message
+template <typename Message>
+class EncodedMessage : public ByteArray<Message::WIRE_SIZE> {
+public:
+  explicit EncodedMessage(const Message &message) {
+    wire::checkLayout<Message>();
+    wire::Encoder encoder{this->mData.data()};
+    Message::fields(message, encoder);
+  }
+};
+
+// Sets the characteristic value to the wire bytes of the message
+template <typename Message>
+bool characteristicSetMessage(IBleServiceLibrary &bleLibrary,
+                              const char *uuid, const Message &message) {
+  const EncodedMessage<Message> encoded(message);
+  return bleLibrary.characteristicSetValue(
+      uuid, encoded.getDataArray().data(), encoded.getDataArray().size());
+}
+
+} // namespace sensirion::upt::ble_server
+
+#endif /* WIRE_CODEC_H */
@@ -7,14 +7,15 @@ bool BatteryBleService::begin() {
   mBleLibrary.createCharacteristic(BATTERY_SERVICE_UUID, BATTERY_LEVEL_UUID,
                                    Permission::READ_PERMISSION |
                                        Permission::NOTIFY_PERMISSION);
-  mBleLibrary.characteristicSetValue(BATTERY_LEVEL_UUID, 0);
+  characteristicSetMessage(mBleLibrary, BATTERY_LEVEL_UUID, BatteryLevel{});
   mBleLibrary.startService(BATTERY_SERVICE_UUID);
 
   return true;
 }
 
 void BatteryBleService::setBatteryLevel(const uint8_t value) const {
-  mBleLibrary.characteristicSetValue(BATTERY_LEVEL_UUID, &value, 1);
+  characteristicSetMessage(mBleLibrary, BATTERY_LEVEL_UUID,
+                           BatteryLevel{value});
   mBleLibrary.characteristicNotify(BATTERY_LEVEL_UUID);
 }
 
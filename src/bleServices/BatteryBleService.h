@@ -1,12 +1,23 @@
 #ifndef ARDUINO_UPT_BLE_SERVER_BATTERY_BLE_SERVICE_H
 #define ARDUINO_UPT_BLE_SERVER_BATTERY_BLE_SERVICE_H
 #include "IBleServiceProvider.h"
+#include "WireCodec.h"
 
 namespace sensirion::upt::ble_server {
 
 constexpr auto BATTERY_SERVICE_UUID = "0000180f-0000-1000-8000-00805f9b34fb";
 constexpr auto BATTERY_LEVEL_UUID = "00002a19-0000-1000-8000-00805f9b34fb";
 
+struct BatteryLevel {
+  static constexpr size_t WIRE_SIZE = 1;
+  uint8_t percent = 0;
+
+  template <typename Self, typename Visitor>
+  static constexpr void fields(Self &self, Visitor &visit) {
+    visit(self.percent);
+  }
+};
+
 class BatteryBleService final : public IBleServiceProvider {
 public:
   explicit BatteryBleService(IBleServiceLibrary &bleLibrary)
@@ -2,168 +2,820 @@
 
 #include "BLEProtocol.h"
 
+#include <bitset>
+
 namespace sensirion::upt::ble_server {
 
 bool DownloadBleService::begin() {
   // set sample size for history before creating services and characteristics
   mSampleHistory.setSampleSize(mSampleConfig.sampleSizeBytes);
+  setupHistoryTiers();
 
   mBleLibrary.createService(DOWNLOAD_SERVICE_UUID);
   mBleLibrary.createCharacteristic(DOWNLOAD_SERVICE_UUID,
                                    NUMBER_OF_SAMPLES_UUID,
                                    Permission::READ_PERMISSION);
-  mBleLibrary.characteristicSetValue(NUMBER_OF_SAMPLES_UUID,
-                                     mSampleHistory.numberOfSamplesInHistory());
+  updateNumberOfSamples();
   mBleLibrary.createCharacteristic(DOWNLOAD_SERVICE_UUID,
                                    REQUESTED_SAMPLES_UUID,
                                    Permission::WRITE_PERMISSION);
   mBleLibrary.createCharacteristic(
       DOWNLOAD_SERVICE_UUID, SAMPLE_HISTORY_INTERVAL_UUID,
       Permission::READ_PERMISSION | Permission::WRITE_PERMISSION);
-  mBleLibrary.characteristicSetValue(SAMPLE_HISTORY_INTERVAL_UUID,
-                                     mHistoryIntervalMilliSeconds);
+  characteristicSetMessage(mBleLibrary, SAMPLE_HISTORY_INTERVAL_UUID,
+                           Uint64Value{mHistoryIntervalMilliSeconds.load()});
   mBleLibrary.createCharacteristic(DOWNLOAD_SERVICE_UUID, DOWNLOAD_PACKET_UUID,
                                    Permission::NOTIFY_PERMISSION);
+  // resolved once, the packet characteristic is used for every packet
+  mDownloadPacketHandle =
+      mBleLibrary.getCharacteristicHandle(DOWNLOAD_PACKET_UUID);
+  mBleLibrary.createCharacteristic(
+      DOWNLOAD_SERVICE_UUID, DOWNLOAD_ACK_UUID,
+      Permission::WRITE_PERMISSION | Permission::WRITE_NO_RESPONSE_PERMISSION);
   mBleLibrary.startService(DOWNLOAD_SERVICE_UUID);
 
-  // create and register callback
-  auto onHistoryIntervalChange = [&](const std::string &value) {
-    const uint32_t sampleIntervalMs =
-        value[0] | (value[1] << 8) | (value[2] << 16) | (value[3] << 24);
-
-    mHistoryIntervalMilliSeconds = sampleIntervalMs;
-    mSampleHistory.reset();
-    mBleLibrary.characteristicSetValue(
-        NUMBER_OF_SAMPLES_UUID, mSampleHistory.numberOfSamplesInHistory());
+  // create and register callback, they run on the BLE stack's task and
+  // queue their requests for the task running the download
+  auto onHistoryIntervalChange = [&](ConnectionHandle /*connection*/,
+                                     const ByteView value) {
+    HistoryIntervalRequest request;
+    if (!decodeMessage(value, request)) {
+      return;
+    }
+    DownloadCommand command;
+    command.type = DownloadCommand::SET_HISTORY_INTERVAL;
+    command.value = request.intervalMs;
+    queueCommand(command);
   };
 
-  mBleLibrary.registerCharacteristicCallback(SAMPLE_HISTORY_INTERVAL_UUID,
-                                             onHistoryIntervalChange);
+  mBleLibrary.registerCharacteristicCallback(
+      mBleLibrary.getCharacteristicHandle(SAMPLE_HISTORY_INTERVAL_UUID),
+      onHistoryIntervalChange);
 
-  auto onNrOfSamplesRequest = [&](const std::string &value) {
-    const uint32_t nrOfSamples =
-        value[0] | (value[1] << 8) | (value[2] << 16) | (value[3] << 24);
+  auto onNrOfSamplesRequest = [&](const ConnectionHandle connection,
+                                  const ByteView value) {
+    SamplesRequest request;
+    if (!decodeMessage(value, request)) {
+      return;
+    }
+    DownloadCommand command;
+    command.type = DownloadCommand::REQUEST_SAMPLES;
+    command.connection = connection;
+    command.value = request.numberOfSamples;
+    command.parameter = request.tier;
+    command.slotMask = request.slotMask;
+    queueCommand(command);
+  };
+  mBleLibrary.registerCharacteristicCallback(
+      mBleLibrary.getCharacteristicHandle(REQUESTED_SAMPLES_UUID),
+      onNrOfSamplesRequest);
 
-    mNrOfSamplesRequested = nrOfSamples;
+  auto onDownloadAckWrite = [&](const ConnectionHandle connection,
+                                const ByteView value) {
+    DownloadAck ack;
+    if (!decodeMessage(value, ack)) {
+      return;
+    }
+    DownloadCommand command;
+    command.type = DownloadCommand::ACKNOWLEDGE;
+    command.connection = connection;
+    command.value = ack.nextExpectedSequenceIdx;
+    command.parameter = ack.retransmit == 1;
+    queueCommand(command);
   };
-  mBleLibrary.registerCharacteristicCallback(REQUESTED_SAMPLES_UUID,
-                                             onNrOfSamplesRequest);
+  mBleLibrary.registerCharacteristicCallback(
+      mBleLibrary.getCharacteristicHandle(DOWNLOAD_ACK_UUID),
+      onDownloadAckWrite);
   return true;
 }
 
+void DownloadBleService::writeValue(const float value, const size_t offset) {
+  mAccumulator.writeValue(value, offset / 2);
+}
+
 void DownloadBleService::commitSample(const Sample &sample) {
+  if (mAccumulatorResetRequested.exchange(false, std::memory_order_acquire)) {
+    mAccumulator.reset();
+  }
+  mAccumulator.commit();
   const uint64_t currentTimeStamp = millis();
-  if (currentTimeStamp - mLatestHistoryTimeStamp >=
-      mHistoryIntervalMilliSeconds) {
-    mSampleHistory.putSample(sample);
-    mLatestHistoryTimeStamp = currentTimeStamp;
+  if (currentTimeStamp - mLatestHistoryTimeStamp <
+      mHistoryIntervalMilliSeconds.load(std::memory_order_relaxed)) {
+    return;
+  }
+  HistoryEntry entry;
+  entry.sample = aggregatedSample(sample);
+  entry.timeStamp = currentTimeStamp;
+  mAccumulator.reset();
+  mLatestHistoryTimeStamp = currentTimeStamp;
+  // stored by the next handleDownload, the queue only fills up if it is not
+  // called for several history intervals
+  if (!mSampleQueue.push(entry)) {
+    mDroppedSamples.fetch_add(1, std::memory_order_relaxed);
+  }
+}
 
-    if (mDownloadState == INACTIVE) {
-      mLatestHistoryTimeStampAtDownloadStart = currentTimeStamp;
-      mBleLibrary.characteristicSetValue(
-          NUMBER_OF_SAMPLES_UUID, mSampleHistory.numberOfSamplesInHistory());
+size_t DownloadBleService::importSamples(const uint8_t *records,
+                                         const size_t count) {
+  const uint64_t timeStamp = millis();
+  const size_t sampleSize = mSampleConfig.sampleSizeBytes;
+  HistoryEntry entry;
+  entry.timeStamp = timeStamp;
+  for (size_t i = 0; i < count; ++i) {
+    entry.sample.setData(&records[i * sampleSize], sampleSize);
+    if (!mSampleQueue.push(entry)) {
+      return i;
     }
   }
+  return count;
 }
 
-void DownloadBleService::handleDownload() {
-  if (mDownloadState == INACTIVE) {
+void DownloadBleService::queueCommand(const DownloadCommand &command) {
+  // a dropped command could leave a session running, e.g. a disconnect, the
+  // command queue is sized for the requests between two handleDownload calls
+  if (!mCommandQueue.push(command)) {
+    mDroppedCommands.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (mEventDriven) {
+    handleDownload();
+  }
+}
+
+void DownloadBleService::processQueues() {
+  DownloadCommand command;
+  while (mCommandQueue.pop(command)) {
+    applyCommand(command);
+  }
+  HistoryEntry entry;
+  bool stored = false;
+  while (mSampleQueue.pop(entry)) {
+    putSample(entry.sample, entry.timeStamp);
+    stored = true;
+  }
+  if (stored && !isDownloading()) {
+    updateNumberOfSamples();
+  }
+}
+
+void DownloadBleService::applyCommand(const DownloadCommand &command) {
+  if (command.type == DownloadCommand::SET_HISTORY_INTERVAL) {
+    mHistoryIntervalMilliSeconds = command.value;
+    // the reset drops the samples of running downloads
+    for (DownloadSession &session : mSessions) {
+      if (session.state == DOWNLOADING || session.state == ABORTED) {
+        abortDownload(session);
+      } else {
+        finishDownload(session);
+      }
+    }
+    mSampleHistory.reset();
+    mAccumulatorResetRequested.store(true, std::memory_order_release);
+    mHistoryTier1.reset();
+    mHistoryTier2.reset();
+    updateNumberOfSamples();
+    return;
+  }
+  if (command.type == DownloadCommand::DISCONNECT) {
+    for (DownloadSession &session : mSessions) {
+      if (session.connection == command.connection) {
+        session.fastConnection = false; // nothing to relax any more
+        finishDownload(session);
+        session.connection = INVALID_CONNECTION_HANDLE;
+      }
+    }
     return;
   }
 
-  // Download Completed
-  if (mDownloadState == COMPLETED) {
-    mDownloadSequenceIdx = 0;
-    mNrOfSamplesRequested = 0;
-    mNumberOfSamplesToDownload = 0;
-    mNumberOfSamplePacketsToDownload = 0;
-    mDownloadState = INACTIVE;
+  DownloadSession *session = sessionFor(command.connection);
+  if (session == nullptr) {
+    // more centrals are connected than download sessions exist
+    return;
+  }
+  switch (command.type) {
+  case DownloadCommand::REQUEST_SAMPLES:
+    session->nrOfSamplesRequested = command.value;
+    session->requestedTier =
+        command.parameter < NUMBER_OF_HISTORY_TIERS ? command.parameter : 0;
+    session->requestedSlotMask = command.slotMask;
+    break;
+  case DownloadCommand::START_DOWNLOAD:
+    session->state = START;
+    session->sequenceIdx = 0;
+    session->ackRetransmits = 0;
+    break;
+  case DownloadCommand::CANCEL_DOWNLOAD:
+    finishDownload(*session);
+    break;
+  case DownloadCommand::ACKNOWLEDGE:
+    onDownloadAck(*session, static_cast<uint16_t>(command.value),
+                  command.parameter);
+    break;
+  case DownloadCommand::CONNECT:
+    session->fastConnection = false;
+    finishDownload(*session);
+    session->requestedTier = 0;
+    session->requestedSlotMask = 0;
+    // the idle parameters are requested by the library on connect
+    break;
+  default:
+    break;
+  }
+}
+
+void DownloadBleService::putSample(const Sample &sample,
+                                   const uint64_t timeStamp) {
+  mSampleHistory.putSample(sample);
+  mLatestTierTimeStamps[0] = timeStamp;
+  if (mHistoryTier1.addSample(sample.getDataArray().data())) {
+    mLatestTierTimeStamps[1] = timeStamp;
+    const uint8_t *record = mHistoryTier1.latestRecord();
+    const size_t sampleSize = mSampleConfig.sampleSizeBytes;
+    if (mHistoryTier2.addAggregate(record, &record[sampleSize],
+                                   &record[2 * sampleSize])) {
+      mLatestTierTimeStamps[2] = timeStamp;
+    }
+  }
+}
+
+Sample DownloadBleService::aggregatedSample(const Sample &sample) const {
+  Sample aggregated = sample;
+  for (const auto &[signalType, slot] : mSampleConfig.sampleSlots) {
+    const size_t slotIndex = slot.offset / 2;
+    if (slot.encodingFunction && mAccumulator.hasValue(slotIndex)) {
+      const float value = mAccumulator.value(slotIndex);
+      aggregated.writeValue(slot.encodingFunction(value), slot.offset);
+    }
+  }
+  return aggregated;
+}
+
+void DownloadBleService::setHistoryTierFactors(const uint16_t tier1Factor,
+                                               const uint16_t tier2Factor) {
+  mHistoryTierFactors[1] = tier1Factor > 0 ? tier1Factor : 1;
+  mHistoryTierFactors[2] = tier2Factor > 0 ? tier2Factor : 1;
+  mHistoryTier1.setSamplesPerRecord(mHistoryTierFactors[1]);
+  mHistoryTier2.setSamplesPerRecord(mHistoryTierFactors[2]);
+}
+
+void DownloadBleService::setupHistoryTiers() {
+  // values whose encoding of a negative number is above the encoding of 0
+  // are stored as signed integers
+  uint16_t signedMask = 0;
+  for (const auto &[signalType, slot] : mSampleConfig.sampleSlots) {
+    if (slot.encodingFunction &&
+        slot.encodingFunction(-1.0f) > slot.encodingFunction(0.0f)) {
+      signedMask |= 1 << (slot.offset / 2);
+    }
+  }
+  mHistoryTier1.setSampleSize(mSampleConfig.sampleSizeBytes);
+  mHistoryTier1.setSignedValues(signedMask);
+  mHistoryTier1.setSamplesPerRecord(mHistoryTierFactors[1]);
+  mHistoryTier2.setSampleSize(mSampleConfig.sampleSizeBytes);
+  mHistoryTier2.setSignedValues(signedMask);
+  mHistoryTier2.setSamplesPerRecord(mHistoryTierFactors[2]);
+}
+
+uint32_t DownloadBleService::numberOfSamplesInTier(const uint8_t tier) {
+  return withHistory(
+      tier, [](auto &history) { return history.numberOfSamplesInHistory(); });
+}
+
+DownloadSession *
+DownloadBleService::sessionFor(const ConnectionHandle connection) {
+  DownloadSession *freeSession = nullptr;
+  for (DownloadSession &session : mSessions) {
+    if (session.connection == connection) {
+      return &session;
+    }
+    if (freeSession == nullptr &&
+        session.connection == INVALID_CONNECTION_HANDLE) {
+      freeSession = &session;
+    }
+  }
+  if (freeSession != nullptr) {
+    freeSession->connection = connection;
+  }
+  return freeSession;
+}
+
+void DownloadBleService::pinReadOut(DownloadSession &session) {
+  const uint8_t tier = session.tier;
+  if (mReadOutUsers[tier] == 0) {
+    // pin the whole history, each session downloads the latest part of it
+    mPinnedSamples[tier] = numberOfSamplesInTier(tier);
+    mPinnedTimeStamps[tier] = mLatestTierTimeStamps[tier];
+    withHistory(tier, [this, tier](auto &history) {
+      history.startReadOut(mPinnedSamples[tier]);
+    });
+    mReadOutPositions[tier] = 0;
+  }
+  ++mReadOutUsers[tier];
+  session.pinsReadOut = true;
+}
+
+void DownloadBleService::releaseReadOut(DownloadSession &session) {
+  if (!session.pinsReadOut) {
     return;
   }
+  session.pinsReadOut = false;
+  if (--mReadOutUsers[session.tier] == 0) {
+    withHistory(session.tier, [](auto &history) { history.endReadOut(); });
+  }
+}
+
+void DownloadBleService::finishDownload(DownloadSession &session) {
+  releaseReadOut(session);
+  session.sequenceIdx = 0;
+  session.failedSends = 0;
+  session.ackRetransmits = 0;
+  session.nrOfSamplesRequested = 0;
+  session.numberOfSamplesToDownload = 0;
+  session.numberOfSamplePacketsToDownload = 0;
+  session.state = INACTIVE;
+  if (session.fastConnection) {
+    session.fastConnection = false;
+    mBleLibrary.updateConnectionParameters(session.connection,
+                                           mIdleConnectionParameters);
+  }
+}
+
+void DownloadBleService::abortDownload(DownloadSession &session) {
+  releaseReadOut(session);
+  // the header is sent like the one of an empty download
+  session.numberOfSamplesToDownload = 0;
+  session.numberOfSamplePacketsToDownload = 0;
+  session.ackWindowSize = 0;
+  session.retransmitRequested = false;
+  session.sequenceIdx = 0;
+  session.failedSends = 0;
+  session.state = ABORTED;
+}
+
+void DownloadBleService::finishInvalidatedDownloads() {
+  for (uint8_t tier = 0; tier < NUMBER_OF_HISTORY_TIERS; ++tier) {
+    if (mReadOutUsers[tier] == 0 ||
+        !withHistory(tier, [](const auto &history) {
+          return history.readOutInvalidated();
+        })) {
+      continue;
+    }
+    // The pinned samples were overwritten, rather abort the downloads than
+    // send different samples than announced in the header
+    for (DownloadSession &session : mSessions) {
+      if (!session.pinsReadOut || session.tier != tier) {
+        continue;
+      }
+      if (session.state == START) {
+        releaseReadOut(session); // a restart pins the history again
+      } else if (session.state == COMPLETED) {
+        finishDownload(session);
+      } else {
+        abortDownload(session);
+      }
+    }
+  }
+}
+
+void DownloadBleService::updateNumberOfSamples() {
+  characteristicSetMessage(
+      mBleLibrary, NUMBER_OF_SAMPLES_UUID,
+      Uint64Value{mSampleHistory.numberOfSamplesInHistory()});
+}
+
+void DownloadBleService::handleDownload() {
+  // packets may already be sent from a BLE event, the holder of
+  // mSendingPackets then runs the download again for this call
+  mDownloadPending.store(true);
+  while (mDownloadPending.load() &&
+         !mSendingPackets.test_and_set(std::memory_order_acquire)) {
+    mDownloadPending.store(false);
+    processQueues();
+    sendDownloadPackets();
+    mSendingPackets.clear(std::memory_order_release);
+  }
+}
+
+void DownloadBleService::sendDownloadPackets() {
+  finishInvalidatedDownloads();
+  const uint32_t startTimeMs = millis();
+  uint16_t packetsSent = 0;
+  uint8_t idleSessions = 0;
+  // one packet per session in turn, until none of them can send
+  while (idleSessions < BLE_SERVER_MAX_DOWNLOAD_SESSIONS) {
+    DownloadSession &session = mSessions[mNextSession];
+    mNextSession = (mNextSession + 1) % BLE_SERVER_MAX_DOWNLOAD_SESSIONS;
+    if (!sendNextDownloadPacket(session)) {
+      ++idleSessions;
+      continue;
+    }
+    idleSessions = 0;
+    ++packetsSent;
+    if (packetsSent >= mMaxPacketsPerHandleDownload) {
+      return;
+    }
+    if (mHandleDownloadTimeBudgetMs > 0 &&
+        millis() - startTimeMs >= mHandleDownloadTimeBudgetMs) {
+      return;
+    }
+  }
+}
+
+bool DownloadBleService::sendNextDownloadPacket(DownloadSession &session) {
+  if (session.state == INACTIVE) {
+    return false;
+  }
+
+  // Download Completed
+  if (session.state == COMPLETED) {
+    finishDownload(session);
+    return false;
+  }
+
+  if (session.state == DOWNLOADING && session.retransmitRequested) {
+    session.retransmitRequested = false;
+    rewindDownload(session, session.retransmitSequenceIdx);
+  }
 
   // Start Download
-  if (mDownloadState == START) {
-    if (mNrOfSamplesRequested > 0 &&
-        mNrOfSamplesRequested < mSampleHistory.numberOfSamplesInHistory()) {
-      mNumberOfSamplesToDownload = mNrOfSamplesRequested;
-    } else {
-      mNumberOfSamplesToDownload = mSampleHistory.numberOfSamplesInHistory();
+  if (session.state == START) {
+    startDownload(session);
+  }
+
+  const uint32_t numberOfPackets = session.numberOfSamplePacketsToDownload;
+  if (session.ackWindowSize > 0) {
+    if (session.sequenceIdx >= numberOfPackets + 1) {
+      // all packets sent, the download completes once they are acknowledged
+      if (session.ackedSequenceIdx >= numberOfPackets + 1) {
+        session.state = COMPLETED;
+        return false;
+      }
+      // send the unacknowledged packets again after the timeout
+      return onAckTimeout(session) && sendNextDownloadPacket(session);
+    }
+    if (session.sequenceIdx >=
+        session.ackedSequenceIdx + session.ackWindowSize) {
+      // window is full, wait for the client to acknowledge
+      return onAckTimeout(session) && sendNextDownloadPacket(session);
     }
-    mNumberOfSamplePacketsToDownload =
-        numberOfPacketsRequired(mNumberOfSamplesToDownload);
-    const DownloadHeader header = buildDownloadHeader();
-    mBleLibrary.characteristicSetValue(DOWNLOAD_PACKET_UUID,
-                                       header.getDataArray().data(),
-                                       header.getDataArray().size());
-    mDownloadState = DOWNLOADING;
-    mSampleHistory.startReadOut(mNumberOfSamplesToDownload);
+  }
+
+  // the packet is sent to the session's central only, a packet that could
+  // not be sent is built again with the next call
+  bool sent;
+  mNotifying.store(true, std::memory_order_relaxed);
+  if (session.sequenceIdx == 0) {
+    const DownloadHeader header = buildDownloadHeader(session);
+    sent = mBleLibrary.characteristicNotify(
+        mDownloadPacketHandle, header.getDataArray().data(),
+        header.getDataArray().size(), session.connection, mTransmitMode);
+  } else {
+    const DownloadPacket packet = buildDownloadPacket(session);
+    sent = mBleLibrary.characteristicNotify(
+        mDownloadPacketHandle, packet.getDataArray().data(), packet.size(),
+        session.connection, mTransmitMode);
+  }
+  mNotifying.store(false, std::memory_order_relaxed);
+  if (!sent) {
+    // transmit queue of the stack is full, retry with the next call unless
+    // sending keeps failing
+    onFailedSend(session);
+    return false;
+  }
+
+  session.failedSends = 0;
+  ++session.sequenceIdx;
+  if (session.sequenceIdx >= numberOfPackets + 1 &&
+      session.ackWindowSize == 0) {
+    session.state = COMPLETED;
+  }
+  return true;
+}
 
-  } else if (mDownloadState == DOWNLOADING) { // Continue Download
-    const DownloadPacket packet = buildDownloadPacket();
-    mBleLibrary.characteristicSetValue(DOWNLOAD_PACKET_UUID,
-                                       packet.getDataArray().data(),
-                                       packet.getDataArray().size());
+void DownloadBleService::onFailedSend(DownloadSession &session) {
+  const uint32_t now = millis();
+  if (session.failedSends == 0) {
+    session.firstFailedSendMs = now;
+  }
+  if (session.failedSends < UINT16_MAX) {
+    ++session.failedSends;
+  }
+  if (session.failedSends >= BLE_SERVER_DOWNLOAD_MAX_FAILED_SENDS &&
+      now - session.firstFailedSendMs >= BLE_SERVER_DOWNLOAD_SEND_TIMEOUT_MS) {
+    finishDownload(session);
   }
+}
 
-  mBleLibrary.characteristicNotify(DOWNLOAD_PACKET_UUID);
+bool DownloadBleService::onAckTimeout(DownloadSession &session) {
+  const uint32_t now = millis();
+  if (now - session.lastAckMs < BLE_SERVER_DOWNLOAD_ACK_TIMEOUT_MS) {
+    return false;
+  }
+  if (session.ackRetransmits >= BLE_SERVER_DOWNLOAD_MAX_ACK_RETRANSMITS) {
+    finishDownload(session);
+    return false;
+  }
+  ++session.ackRetransmits;
+  session.lastAckMs = now;
+  rewindDownload(session, session.ackedSequenceIdx);
+  return true;
+}
 
-  ++mDownloadSequenceIdx;
-  if (mDownloadSequenceIdx >= mNumberOfSamplePacketsToDownload + 1) {
-    mDownloadState = COMPLETED;
+void DownloadBleService::startDownload(DownloadSession &session) {
+  if (mAdaptiveConnectionParameters && !session.fastConnection) {
+    session.fastConnection = true;
+    mBleLibrary.updateConnectionParameters(session.connection,
+                                           mDownloadConnectionParameters);
   }
+  // a restarted download reads out the latest samples again
+  releaseReadOut(session);
+  session.tier = session.requestedTier;
+  pinReadOut(session);
+  const uint32_t numberOfSamples = mPinnedSamples[session.tier];
+  if (session.nrOfSamplesRequested > 0 &&
+      session.nrOfSamplesRequested < numberOfSamples) {
+    session.numberOfSamplesToDownload = session.nrOfSamplesRequested;
+  } else {
+    session.numberOfSamplesToDownload = numberOfSamples;
+  }
+  session.readOutStartByte =
+      (numberOfSamples - session.numberOfSamplesToDownload) *
+      downloadRecordSize(session.tier);
+  session.ackWindowSize = mAckWindowSize;
+  session.ackedSequenceIdx = 0;
+  session.lastAckMs = millis();
+  session.retransmitRequested = false;
+  session.sequenceIdx = 0;
+  session.failedSends = 0;
+  session.packetSize =
+      downloadPacketSizeForMtu(mBleLibrary.getMtu(session.connection));
+  const size_t maxRecordSize =
+      session.packetSize - DOWNLOAD_PACKET_HEADER_SIZE_BYTES;
+  // selected slots are sent as whole records, all slots if they do not fit
+  session.slotMask = selectedSlots(session.requestedSlotMask);
+  if (sentRecordSize(session) > maxRecordSize) {
+    session.slotMask = 0;
+  }
+  // records that do not fit a packet can only be sent packed
+  session.isPacked =
+      session.slotMask == 0 &&
+      (mPackedDownload || downloadRecordSize(session.tier) > maxRecordSize);
+  session.numberOfSamplePacketsToDownload = numberOfPacketsRequired(session);
+  session.state = DOWNLOADING;
 }
 
 bool DownloadBleService::isDownloading() const {
-  return (mDownloadState != INACTIVE);
+  for (const DownloadSession &session : mSessions) {
+    if (session.state != INACTIVE) {
+      return true;
+    }
+  }
+  return false;
 }
 
-void DownloadBleService::onConnect() {
-  mDownloadSequenceIdx = 0;
-  mDownloadState = INACTIVE;
+void DownloadBleService::onConnect(const ConnectionHandle connection) {
+  DownloadCommand command;
+  command.type = DownloadCommand::CONNECT;
+  command.connection = connection;
+  queueCommand(command);
 }
 
-void DownloadBleService::onDisconnect() { mDownloadState = INACTIVE; }
-void DownloadBleService::onSubscribe(const std::string &uuid,
+void DownloadBleService::onDisconnect(const ConnectionHandle connection) {
+  DownloadCommand command;
+  command.type = DownloadCommand::DISCONNECT;
+  command.connection = connection;
+  queueCommand(command);
+}
+void DownloadBleService::onSubscribe(const ConnectionHandle connection,
+                                     const std::string &uuid,
                                      const uint16_t subValue) {
-  if (strcmp(uuid.c_str(), DOWNLOAD_PACKET_UUID) == 0 && subValue == 1) {
-    // start download
-    mDownloadState = START;
+  if (strcmp(uuid.c_str(), DOWNLOAD_PACKET_UUID) != 0) {
+    return;
+  }
+  // subscribing to notifications or indications starts the download,
+  // unsubscribing cancels it
+  DownloadCommand command;
+  command.type = subValue == 0 ? DownloadCommand::CANCEL_DOWNLOAD
+                               : DownloadCommand::START_DOWNLOAD;
+  command.connection = connection;
+  queueCommand(command);
+}
+
+void DownloadBleService::onNotifyStatus(const std::string &uuid,
+                                        const bool success) {
+  // Notifications report their status from within characteristicNotify.
+  // The running burst goes on by itself, running the download again from
+  // there would send past the burst limits until a send fails.
+  if (!mEventDriven || !success || mNotifying.load(std::memory_order_relaxed) ||
+      strcmp(uuid.c_str(), DOWNLOAD_PACKET_UUID) != 0) {
+    return;
   }
+  handleDownload();
 }
 
-DownloadHeader DownloadBleService::buildDownloadHeader() const {
+DownloadHeader
+DownloadBleService::buildDownloadHeader(const DownloadSession &session) const {
   DownloadHeader header;
   const uint32_t age =
-      static_cast<uint32_t>(millis() - mLatestHistoryTimeStampAtDownloadStart);
+      static_cast<uint32_t>(millis() - mPinnedTimeStamps[session.tier]);
+  uint64_t interval = mHistoryIntervalMilliSeconds;
+  for (uint8_t tier = 1; tier <= session.tier; ++tier) {
+    interval *= mHistoryTierFactors[tier];
+  }
   header.setDownloadSampleType(mSampleConfig.downloadType);
-  header.setIntervalMilliSeconds(mHistoryIntervalMilliSeconds);
+  header.setIntervalMilliSeconds(static_cast<uint32_t>(interval));
   header.setAgeOfLatestSampleMilliSeconds(age);
   header.setDownloadSampleCount(
-      static_cast<uint16_t>(mNumberOfSamplesToDownload));
+      static_cast<uint16_t>(session.numberOfSamplesToDownload));
+  uint8_t flags = 0;
+  if (session.isPacked) {
+    flags |= DOWNLOAD_FLAG_PACKED_SAMPLES;
+  }
+  if (session.ackWindowSize > 0) {
+    flags |= DOWNLOAD_FLAG_ACKNOWLEDGED;
+  }
+  if (session.slotMask != 0) {
+    flags |= DOWNLOAD_FLAG_SELECTED_SLOTS;
+  }
+  if (session.state == ABORTED) {
+    flags |= DOWNLOAD_FLAG_ABORTED;
+  }
+  flags |=
+      (session.tier << DOWNLOAD_FLAG_TIER_SHIFT) & DOWNLOAD_FLAG_TIER_MASK;
+  header.setDownloadFlags(flags);
+  header.setPacketSizeBytes(static_cast<uint8_t>(session.packetSize));
+  header.setSlotMask(session.slotMask);
   return header;
 }
 
-DownloadPacket DownloadBleService::buildDownloadPacket() {
-  DownloadPacket packet;
-  packet.setDownloadSequenceNumber(mDownloadSequenceIdx);
-  bool allSamplesRead = false;
-  for (int i = 0; i < mSampleConfig.sampleCountPerPacket && !allSamplesRead;
-       ++i) {
-    Sample sample = mSampleHistory.readOutNextSample(allSamplesRead);
-    packet.writeSample(sample, mSampleConfig.sampleSizeBytes, i);
+DownloadPacket
+DownloadBleService::buildDownloadPacket(const DownloadSession &session) {
+  DownloadPacket packet(session.packetSize);
+  packet.setDownloadSequenceNumber(session.sequenceIdx);
+  const uint8_t tier = session.tier;
+  const size_t position = session.readOutStartByte +
+                          (session.sequenceIdx - 1) * payloadSize(session);
+  // the read out is shared by all sessions downloading from this tier
+  if (mReadOutPositions[tier] != position) {
+    withHistory(tier, [position](auto &history) {
+      history.seekReadOut(position);
+    });
   }
+  // read the samples straight from the history into the packet
+  uint8_t *sampleData = packet.sampleData();
+  size_t bytesRead;
+  if (session.isPacked) {
+    const size_t size = payloadSize(session);
+    bytesRead = withHistory(tier, [sampleData, size](auto &history) {
+      return history.readOutNextBytes(sampleData, size);
+    });
+  } else if (session.slotMask != 0) {
+    // read the records one by one and keep the selected slots
+    uint8_t record[MAX_SAMPLE_SIZE_BYTES * HISTORY_TIER_VALUES_PER_RECORD];
+    const size_t sampleCount = samplesPerPacket(session);
+    const size_t recordSize = sentRecordSize(session);
+    size_t recordsRead = 0;
+    while (recordsRead < sampleCount &&
+           withHistory(tier, [&record](auto &history) {
+             return history.readOutNextSamples(record, 1);
+           }) == 1) {
+      projectRecord(session, record, &sampleData[recordsRead * recordSize]);
+      ++recordsRead;
+    }
+    bytesRead = recordsRead * downloadRecordSize(tier);
+  } else {
+    const size_t sampleCount = samplesPerPacket(session);
+    bytesRead = withHistory(tier, [sampleData, sampleCount](auto &history) {
+      return history.readOutNextSamples(sampleData, sampleCount);
+    });
+    bytesRead *= downloadRecordSize(tier);
+  }
+  mReadOutPositions[tier] = position + bytesRead;
   return packet;
 }
 
+void DownloadBleService::onDownloadAck(DownloadSession &session,
+                                       const uint16_t nextExpectedSequenceIdx,
+                                       const bool retransmit) {
+  if (session.state != DOWNLOADING ||
+      nextExpectedSequenceIdx > session.sequenceIdx) {
+    return;
+  }
+  if (nextExpectedSequenceIdx > session.ackedSequenceIdx) {
+    session.ackedSequenceIdx = nextExpectedSequenceIdx;
+    session.lastAckMs = millis();
+    session.ackRetransmits = 0;
+  }
+  if (retransmit) {
+    session.retransmitSequenceIdx = nextExpectedSequenceIdx;
+    session.retransmitRequested = true;
+  }
+}
+
+void DownloadBleService::rewindDownload(DownloadSession &session,
+                                        const uint16_t sequenceIdx) {
+  if (sequenceIdx == 0) {
+    // the header is requested again, restart the download
+    session.state = START;
+  }
+  // packets are read from the position given by their sequence number
+  session.sequenceIdx = sequenceIdx;
+}
+
+size_t DownloadBleService::downloadPacketSizeForMtu(const uint16_t mtu) const {
+  // the ATT notification header takes 3 bytes of the MTU
+  const size_t maxPacketSizeForMtu = mtu - 3;
+  if (maxPacketSizeForMtu < DOWNLOAD_PACKET_SIZE_BYTES) {
+    return DOWNLOAD_PACKET_SIZE_BYTES;
+  }
+  return maxPacketSizeForMtu < mMaxDownloadPacketSize ? maxPacketSizeForMtu
+                                                       : mMaxDownloadPacketSize;
+}
+
+size_t DownloadBleService::downloadRecordSize(const uint8_t tier) const {
+  if (tier == 0) {
+    return mSampleConfig.sampleSizeBytes;
+  }
+  return mSampleConfig.sampleSizeBytes * HISTORY_TIER_VALUES_PER_RECORD;
+}
+
+uint16_t
+DownloadBleService::selectedSlots(const uint16_t requestedSlotMask) const {
+  const size_t numberOfSlots = mSampleConfig.sampleSizeBytes / 2;
+  const auto allSlots = static_cast<uint16_t>((1u << numberOfSlots) - 1);
+  const uint16_t slotMask = requestedSlotMask & allSlots;
+  // a trailing byte of an odd sample size is only sent with whole samples
+  if (slotMask == allSlots && mSampleConfig.sampleSizeBytes % 2 == 0) {
+    return 0;
+  }
+  return slotMask;
+}
+
+size_t
+DownloadBleService::sentRecordSize(const DownloadSession &session) const {
+  if (session.slotMask == 0) {
+    return downloadRecordSize(session.tier);
+  }
+  const size_t valuesPerRecord =
+      session.tier == 0 ? 1 : HISTORY_TIER_VALUES_PER_RECORD;
+  return valuesPerRecord * 2 * std::bitset<16>(session.slotMask).count();
+}
+
+void DownloadBleService::projectRecord(const DownloadSession &session,
+                                       const uint8_t *record,
+                                       uint8_t *destination) const {
+  const size_t sampleSize = mSampleConfig.sampleSizeBytes;
+  const size_t valuesPerRecord =
+      session.tier == 0 ? 1 : HISTORY_TIER_VALUES_PER_RECORD;
+  for (size_t value = 0; value < valuesPerRecord; ++value) {
+    const uint8_t *sample = &record[value * sampleSize];
+    for (size_t slot = 0; slot < 16; ++slot) {
+      if (session.slotMask & (1 << slot)) {
+        *destination++ = sample[2 * slot];
+        *destination++ = sample[2 * slot + 1];
+      }
+    }
+  }
+}
+
+size_t
+DownloadBleService::payloadSize(const DownloadSession &session) const {
+  if (session.isPacked) {
+    return session.packetSize - DOWNLOAD_PACKET_HEADER_SIZE_BYTES;
+  }
+  return samplesPerPacket(session) * downloadRecordSize(session.tier);
+}
+
+size_t
+DownloadBleService::samplesPerPacket(const DownloadSession &session) const {
+  const size_t fittingSamples =
+      (session.packetSize - DOWNLOAD_PACKET_HEADER_SIZE_BYTES) /
+      sentRecordSize(session);
+  // the configured count is kept for the default packet if it fits
+  if (session.packetSize == DOWNLOAD_PACKET_SIZE_BYTES && session.tier == 0 &&
+      session.slotMask == 0 && mSampleConfig.sampleCountPerPacket > 0 &&
+      mSampleConfig.sampleCountPerPacket <= fittingSamples) {
+    return mSampleConfig.sampleCountPerPacket;
+  }
+  return fittingSamples;
+}
+
 uint32_t DownloadBleService::numberOfPacketsRequired(
-    const uint32_t numberOfSamples) const {
-  uint32_t numberOfPacketsRequired =
-      numberOfSamples / mSampleConfig.sampleCountPerPacket;
+    const DownloadSession &session) const {
+  const uint32_t numberOfSamples = session.numberOfSamplesToDownload;
+  if (session.isPacked) {
+    const uint32_t numberOfBytes =
+        numberOfSamples * downloadRecordSize(session.tier);
+    const size_t size = payloadSize(session);
+    return (numberOfBytes + size - 1) / size;
+  }
+
+  const size_t sampleCountPerPacket = samplesPerPacket(session);
+  uint32_t numberOfPacketsRequired = numberOfSamples / sampleCountPerPacket;
 
-  if (numberOfSamples % mSampleConfig.sampleCountPerPacket != 0) {
+  if (numberOfSamples % sampleCountPerPacket != 0) {
     ++numberOfPacketsRequired;
   }
   return numberOfPacketsRequired;
 }
 
-} // namespace sensirion::upt::ble_server
\ No newline at end of file
+} // namespace sensirion::upt::ble_server
@@ -1,10 +1,19 @@
 #ifndef ARDUINO_UPT_BLE_SERVER_DOWNLOAD_BLE_SERVICE_H
 #define ARDUINO_UPT_BLE_SERVER_DOWNLOAD_BLE_SERVICE_H
+#include "ColumnarSampleHistory.h"
+#include "CompressedSampleHistory.h"
 #include "Download.h"
+#include "FixedSampleHistoryRingBuffer.h"
 #include "IBleServiceProvider.h"
+#include "SampleAccumulator.h"
 #include "SampleHistoryRingBuffer.h"
+#include "SampleHistoryTier.h"
+#include "SpscQueue.h"
+#include "WireCodec.h"
 
 #include <BLEProtocol.h>
+#include <algorithm>
+#include <atomic>
 
 namespace sensirion::upt::ble_server {
 
@@ -18,11 +27,191 @@ static constexpr auto REQUESTED_SAMPLES_UUID =
     "00008003-b38d-4985-720e-0f993a68ee41";
 static constexpr auto DOWNLOAD_PACKET_UUID =
     "00008004-b38d-4985-720e-0f993a68ee41";
+static constexpr auto DOWNLOAD_ACK_UUID =
+    "00008005-b38d-4985-720e-0f993a68ee41";
 
 #ifndef BLE_SERVER_HISTORY_BUFFER_SIZE
 #define BLE_SERVER_HISTORY_BUFFER_SIZE SAMPLE_HISTORY_RING_BUFFER_SIZE_BYTES
 #endif
 
+// Define BLE_SERVER_HISTORY_SAMPLE_SIZE to the sample size in bytes of the
+// only data type the firmware uses to get a history specialized for it.
+// Define BLE_SERVER_COMPRESSED_HISTORY to store the history delta compressed.
+// Define BLE_SERVER_COLUMNAR_HISTORY to store each slot in its own ring.
+#if defined(BLE_SERVER_HISTORY_SAMPLE_SIZE)
+using SampleHistory = FixedSampleHistoryRingBuffer<
+    BLE_SERVER_HISTORY_SAMPLE_SIZE,
+    fixedHistoryCapacity(BLE_SERVER_HISTORY_BUFFER_SIZE,
+                         BLE_SERVER_HISTORY_SAMPLE_SIZE)>;
+#elif defined(BLE_SERVER_COMPRESSED_HISTORY)
+using SampleHistory = CompressedSampleHistory<BLE_SERVER_HISTORY_BUFFER_SIZE>;
+#elif defined(BLE_SERVER_COLUMNAR_HISTORY)
+using SampleHistory = ColumnarSampleHistory<BLE_SERVER_HISTORY_BUFFER_SIZE>;
+#else
+// ReSharper disable once CppRedundantTemplateArguments
+using SampleHistory = SampleHistoryRingBuffer<BLE_SERVER_HISTORY_BUFFER_SIZE>;
+#endif
+
+// Buffer sizes of the coarse history tiers holding min, mean and max of
+// several samples, 0 disables a tier
+#ifndef BLE_SERVER_HISTORY_TIER_1_BUFFER_SIZE
+#define BLE_SERVER_HISTORY_TIER_1_BUFFER_SIZE 0
+#endif
+#ifndef BLE_SERVER_HISTORY_TIER_2_BUFFER_SIZE
+#define BLE_SERVER_HISTORY_TIER_2_BUFFER_SIZE 0
+#endif
+
+static constexpr uint8_t NUMBER_OF_HISTORY_TIERS = 3;
+
+// Queue sizes for handing committed history samples from the measurement
+// task and requests from the BLE stack's task to handleDownload, must be
+// powers of two. Only handleDownload stores the samples and applies the
+// requests, the queues must hold those arriving between two calls. Samples
+// and requests that do not fit are dropped and counted.
+#ifndef BLE_SERVER_SAMPLE_QUEUE_SIZE
+#define BLE_SERVER_SAMPLE_QUEUE_SIZE 4
+#endif
+#ifndef BLE_SERVER_DOWNLOAD_COMMAND_QUEUE_SIZE
+#define BLE_SERVER_DOWNLOAD_COMMAND_QUEUE_SIZE 16
+#endif
+
+// Number of centrals that can download at the same time, each one uses a
+// download session with its own position in the shared history
+#ifndef BLE_SERVER_MAX_DOWNLOAD_SESSIONS
+#define BLE_SERVER_MAX_DOWNLOAD_SESSIONS 3
+#endif
+
+// A download whose packets could not be sent this many times in a row over
+// at least the timeout is ended, e.g. if the central stopped receiving. Both
+// must be exceeded so a briefly full transmit queue does not end it.
+#ifndef BLE_SERVER_DOWNLOAD_MAX_FAILED_SENDS
+#define BLE_SERVER_DOWNLOAD_MAX_FAILED_SENDS 20
+#endif
+#ifndef BLE_SERVER_DOWNLOAD_SEND_TIMEOUT_MS
+#define BLE_SERVER_DOWNLOAD_SEND_TIMEOUT_MS 5000
+#endif
+
+// In acknowledged downloads, the packets after the last acknowledged one are
+// sent again if no acknowledgement arrives within the timeout. The download
+// is ended once this happened the given number of times in a row.
+#ifndef BLE_SERVER_DOWNLOAD_ACK_TIMEOUT_MS
+#define BLE_SERVER_DOWNLOAD_ACK_TIMEOUT_MS 2000
+#endif
+#ifndef BLE_SERVER_DOWNLOAD_MAX_ACK_RETRANSMITS
+#define BLE_SERVER_DOWNLOAD_MAX_ACK_RETRANSMITS 3
+#endif
+
+// Wire layouts of the download characteristics
+struct HistoryIntervalRequest {
+  static constexpr size_t WIRE_SIZE = 4;
+  uint32_t intervalMs = 0;
+
+  template <typename Self, typename Visitor>
+  static constexpr void fields(Self &self, Visitor &visit) {
+    visit(self.intervalMs);
+  }
+};
+
+// Bit i of the slot mask selects the 16 bit slot at offset 2 * i, 0 selects
+// whole samples
+struct SamplesRequest {
+  static constexpr size_t WIRE_SIZE = 7;
+  static constexpr size_t MIN_WIRE_SIZE = 4; // tier and slots are optional
+  uint32_t numberOfSamples = 0;
+  uint8_t tier = 0;
+  uint16_t slotMask = 0;
+
+  template <typename Self, typename Visitor>
+  static constexpr void fields(Self &self, Visitor &visit) {
+    visit(self.numberOfSamples);
+    visit(self.tier);
+    visit(self.slotMask);
+  }
+};
+
+// The next expected sequence number, retransmit set to 1 requests to send
+// the packets from this sequence number again
+struct DownloadAck {
+  static constexpr size_t WIRE_SIZE = 3;
+  static constexpr size_t MIN_WIRE_SIZE = 2;
+  uint16_t nextExpectedSequenceIdx = 0;
+  uint8_t retransmit = 0;
+
+  template <typename Self, typename Visitor>
+  static constexpr void fields(Self &self, Visitor &visit) {
+    visit(self.nextExpectedSequenceIdx);
+    visit(self.retransmit);
+  }
+};
+
+// The number of samples and the history interval are read as 64 bit values
+struct Uint64Value {
+  static constexpr size_t WIRE_SIZE = 8;
+  uint64_t value = 0;
+
+  template <typename Self, typename Visitor>
+  static constexpr void fields(Self &self, Visitor &visit) {
+    visit(self.value);
+  }
+};
+
+// A sample to be stored in the history
+struct HistoryEntry {
+  Sample sample;
+  uint64_t timeStamp = 0;
+};
+
+// A request from the BLE stack, applied by the task running the download
+struct DownloadCommand {
+  enum Type : uint8_t {
+    SET_HISTORY_INTERVAL,
+    REQUEST_SAMPLES,
+    START_DOWNLOAD,
+    CANCEL_DOWNLOAD,
+    ACKNOWLEDGE,
+    CONNECT,
+    DISCONNECT
+  };
+  Type type = START_DOWNLOAD;
+  ConnectionHandle connection = INVALID_CONNECTION_HANDLE;
+  uint32_t value = 0;
+  uint8_t parameter = 0; // tier of REQUEST_SAMPLES, retransmit of ACKNOWLEDGE
+  uint16_t slotMask = 0;  // of REQUEST_SAMPLES
+};
+
+// Download of one connected central. The downloaded samples are the latest
+// ones of the range pinned in the history of the tier, the sequence number
+// of the next packet determines the position in this range.
+struct DownloadSession {
+  ConnectionHandle connection = INVALID_CONNECTION_HANDLE;
+  std::atomic<DownloadState> state{INACTIVE};
+  uint32_t nrOfSamplesRequested = 0;
+  uint8_t requestedTier = 0;
+  uint8_t tier = 0;          // of the running download
+  uint16_t requestedSlotMask = 0;
+  uint16_t slotMask = 0;     // sent slots of the running download, 0 = all
+  bool pinsReadOut = false;  // holds the pinned range of the tier
+  bool fastConnection = false; // download parameters were requested
+  bool isPacked = false;     // mode of the running download
+  size_t packetSize = DOWNLOAD_PACKET_SIZE_BYTES;
+  size_t readOutStartByte = 0; // of the first sample in the pinned range
+  uint16_t ackWindowSize = 0;    // window of the running download
+  uint16_t ackedSequenceIdx = 0; // all packets before are received
+  bool retransmitRequested = false;
+  uint16_t retransmitSequenceIdx = 0;
+  uint32_t lastAckMs = 0;        // or start of the download
+  uint8_t ackRetransmits = 0;    // timeouts since the last acknowledgement
+  uint16_t sequenceIdx = 0; // the first packet is the header
+  uint16_t failedSends = 0;  // in a row, since firstFailedSendMs
+  uint32_t firstFailedSendMs = 0;
+  uint32_t numberOfSamplesToDownload = 0;
+  uint32_t numberOfSamplePacketsToDownload = 0;
+};
+
+// Serves the sample history to the connected centrals. A download whose
+// announced samples can not be sent any more, because they were overwritten
+// or the history interval changed, ends with a header flagged
+// DOWNLOAD_FLAG_ABORTED instead of its remaining packets.
 class DownloadBleService final : IBleServiceProvider {
 public:
   explicit DownloadBleService(IBleServiceLibrary &bleLibrary,
@@ -31,39 +220,259 @@ public:
 
   bool begin() override;
 
+  // Records the decoded value of the slot at offset for the next commit
+  void writeValue(float value, size_t offset);
+  // Called from the measurement task. A history sample is queued for the
+  // next handleDownload, which stores it.
   void commitSample(const Sample &sample);
+  // Queues count records of the sample size, oldest first, to be stored as
+  // the history up to now by the next handleDownload. Bypasses the
+  // aggregation. Returns the number of queued records, less than count if
+  // the sample queue is full; pass the rest after the next handleDownload.
+  size_t importSamples(const uint8_t *records, size_t count);
+  // How the values committed during a history interval are combined
+  void setAggregationMode(const AggregationMode mode) {
+    mAccumulator.setMode(mode);
+  }
+  // Stores the queued samples, applies the queued requests and sends the
+  // download packets. Called from the loop and, if event driven, from the
+  // BLE stack's task; concurrent calls are merged, never waited for.
   void handleDownload();
+  // History samples dropped because the sample queue was full
+  [[nodiscard]] uint32_t numberOfDroppedSamples() const {
+    return mDroppedSamples.load(std::memory_order_relaxed);
+  }
+  // Requests of centrals dropped because the command queue was full
+  [[nodiscard]] uint32_t numberOfDroppedCommands() const {
+    return mDroppedCommands.load(std::memory_order_relaxed);
+  }
+  // Send up to maxPackets packets per handleDownload call, stopping early
+  // when the time budget is used up (0 = no budget) or the stack's transmit
+  // queue is full.
+  void setDownloadBurst(const uint16_t maxPackets,
+                        const uint32_t timeBudgetMs = 0) {
+    mMaxPacketsPerHandleDownload = maxPackets > 0 ? maxPackets : 1;
+    mHandleDownloadTimeBudgetMs = timeBudgetMs;
+  }
   [[nodiscard]] bool isDownloading() const;
-  void setSampleConfig(const core::SampleConfig &sampleConfig) {
+  // Send the samples as a continuous byte stream filling every packet.
+  // Applies from the next download on; the header announces the mode.
+  void setPackedDownload(const bool packed) { mPackedDownload = packed; }
+  // Upper limit for the download packet size. Packets are sized to the MTU
+  // negotiated at download start, but never exceed this limit.
+  void setMaxDownloadPacketSize(const size_t size) {
+    mMaxDownloadPacketSize =
+        std::min(std::max(size, DOWNLOAD_PACKET_SIZE_BYTES),
+                 MAX_DOWNLOAD_PACKET_SIZE_BYTES);
+  }
+  // Send download packets as indications (default) or notifications
+  void setDownloadTransmitMode(const TransmitMode mode) {
+    mTransmitMode = mode;
+  }
+  // Require the client to acknowledge packets on DOWNLOAD_ACK_UUID with at
+  // most windowSize packets in flight, 0 disables acknowledgements.
+  // Applies from the next download on; the header announces the mode.
+  void setDownloadAckWindow(const uint16_t windowSize) {
+    mAckWindowSize = windowSize;
+  }
+  // Request the download parameters for a connection when its download
+  // starts and the idle parameters once it completes. The library requests
+  // the idle parameters on connect, false if it rejects them.
+  bool setAdaptiveConnectionParameters(const ConnectionParameters &download,
+                                       const ConnectionParameters &idle) {
+    if (!mBleLibrary.setConnectParameters(idle)) {
+      return false;
+    }
+    mDownloadConnectionParameters = download;
+    mIdleConnectionParameters = idle;
+    mAdaptiveConnectionParameters = true;
+    return true;
+  }
+  // Send the next packets from transmit-complete, subscribe and ack events
+  // of the BLE stack in addition to handleDownload calls
+  void setEventDrivenDownload(const bool enable) { mEventDriven = enable; }
+  // Number of history samples aggregated into one record of tier 1 and
+  // number of tier 1 records aggregated into one record of tier 2
+  void setHistoryTierFactors(uint16_t tier1Factor, uint16_t tier2Factor);
+  // false if the history does not store samples of the configured size,
+  // see BLE_SERVER_HISTORY_SAMPLE_SIZE, the configuration is kept then
+  bool setSampleConfig(const core::SampleConfig &sampleConfig) {
+    if (!mSampleHistory.setSampleSize(sampleConfig.sampleSizeBytes)) {
+      mSampleHistory.setSampleSize(mSampleConfig.sampleSizeBytes);
+      return false;
+    }
     mSampleConfig = sampleConfig;
-    mSampleHistory.setSampleSize(mSampleConfig.sampleSizeBytes);
+    mAccumulator.clear();
+    setupHistoryTiers();
+    return true;
   }
 
-  void onConnect() override;
-  void onDisconnect() override;
-  void onSubscribe(const std::string &uuid, uint16_t subValue) override;
+  // the overloads without connection are still called from the base class
+  using IBleServiceProvider::onConnect;
+  using IBleServiceProvider::onDisconnect;
+  using IBleServiceProvider::onSubscribe;
+  void onConnect(ConnectionHandle connection) override;
+  void onDisconnect(ConnectionHandle connection) override;
+  void onSubscribe(ConnectionHandle connection, const std::string &uuid,
+                   uint16_t subValue) override;
+  void onNotifyStatus(const std::string &uuid, bool success) override;
 
 private:
   core::SampleConfig mSampleConfig;
-  // ReSharper disable once CppRedundantTemplateArguments
-  SampleHistoryRingBuffer<BLE_SERVER_HISTORY_BUFFER_SIZE> mSampleHistory;
-  uint32_t mNrOfSamplesRequested = 0;
-  DownloadState mDownloadState = INACTIVE;
-  uint16_t mDownloadSequenceIdx = 0; // the first packet is the header
-  uint32_t mNumberOfSamplesToDownload = 0;
-  uint32_t mNumberOfSamplePacketsToDownload = 0;
-
-  uint64_t mHistoryIntervalMilliSeconds = 600000; // = 10 minutes
-  uint64_t mLatestHistoryTimeStamp = 0;
-  uint64_t mLatestHistoryTimeStampAtDownloadStart = 0;
+  CharacteristicHandle mDownloadPacketHandle = INVALID_CHARACTERISTIC_HANDLE;
+  SampleAccumulator mAccumulator;
+  SampleHistory mSampleHistory;
+  SampleHistoryTier<BLE_SERVER_HISTORY_TIER_1_BUFFER_SIZE> mHistoryTier1;
+  SampleHistoryTier<BLE_SERVER_HISTORY_TIER_2_BUFFER_SIZE> mHistoryTier2;
+  uint16_t mHistoryTierFactors[NUMBER_OF_HISTORY_TIERS] = {1, 6, 24};
+  // of the latest sample or record stored in the history of each tier
+  uint64_t mLatestTierTimeStamps[NUMBER_OF_HISTORY_TIERS] = {};
+  DownloadSession mSessions[BLE_SERVER_MAX_DOWNLOAD_SESSIONS];
+  uint8_t mNextSession = 0; // the next one to send a packet
+  // the history of a tier stays pinned while a session downloads from it
+  uint8_t mReadOutUsers[NUMBER_OF_HISTORY_TIERS] = {};
+  uint32_t mPinnedSamples[NUMBER_OF_HISTORY_TIERS] = {};
+  uint64_t mPinnedTimeStamps[NUMBER_OF_HISTORY_TIERS] = {};
+  // byte offset of the read out in the pinned range, to only seek when
+  // switching between sessions
+  size_t mReadOutPositions[NUMBER_OF_HISTORY_TIERS] = {};
+  bool mPackedDownload = false;
+  size_t mMaxDownloadPacketSize = DOWNLOAD_PACKET_SIZE_BYTES;
+  uint16_t mMaxPacketsPerHandleDownload = 1;
+  uint32_t mHandleDownloadTimeBudgetMs = 0;
+  bool mEventDriven = false;
+  // set while a handleDownload call uses the download state, the history
+  // and the queues' consumer side
+  std::atomic_flag mSendingPackets = ATOMIC_FLAG_INIT;
+  // a handleDownload call found mSendingPackets set, the holder runs the
+  // download again before returning
+  std::atomic<bool> mDownloadPending{false};
+  // set while a download packet is handed to the stack, to tell status
+  // events raised from within the call from those of earlier packets
+  std::atomic<bool> mNotifying{false};
+  SpscQueue<HistoryEntry, BLE_SERVER_SAMPLE_QUEUE_SIZE> mSampleQueue;
+  SpscQueue<DownloadCommand, BLE_SERVER_DOWNLOAD_COMMAND_QUEUE_SIZE>
+      mCommandQueue;
+  std::atomic<uint32_t> mDroppedSamples{0};
+  std::atomic<uint32_t> mDroppedCommands{0};
+  // set by a history interval change, the aggregate is restarted by the
+  // task committing samples as it owns the accumulator
+  std::atomic<bool> mAccumulatorResetRequested{false};
+  TransmitMode mTransmitMode = TransmitMode::INDICATE;
+  uint16_t mAckWindowSize = 0;
+  bool mAdaptiveConnectionParameters = false;
+  ConnectionParameters mDownloadConnectionParameters;
+  ConnectionParameters mIdleConnectionParameters;
+
+  std::atomic<uint32_t> mHistoryIntervalMilliSeconds{600000}; // = 10 minutes
+  uint64_t mLatestHistoryTimeStamp = 0; // of the measurement task
 
 private:
-  [[nodiscard]] DownloadHeader buildDownloadHeader() const;
+  void setupHistoryTiers();
+
+  // The committed sample with the aggregated values of the interval
+  [[nodiscard]] Sample aggregatedSample(const Sample &sample) const;
+
+  // Calls function with the history of the given tier
+  template <typename Function>
+  auto withHistory(const uint8_t tier, Function function) {
+    if (tier == 1) {
+      return function(mHistoryTier1);
+    }
+    if (tier == 2) {
+      return function(mHistoryTier2);
+    }
+    return function(mSampleHistory);
+  }
+
+  [[nodiscard]] uint32_t numberOfSamplesInTier(uint8_t tier);
+
+  // The session of the connection, a free one is assigned to a new
+  // connection. nullptr if all sessions are in use.
+  DownloadSession *sessionFor(ConnectionHandle connection);
+
+  // Pins the history of the session's tier unless another session already
+  // did, the session then downloads from the same range
+  void pinReadOut(DownloadSession &session);
+
+  // Releases the session's pin on the history of its tier
+  void releaseReadOut(DownloadSession &session);
+
+  // Ends the download of the session and releases its pin
+  void finishDownload(DownloadSession &session);
+
+  // Ends a running download early and releases its pin. The central is told
+  // with a header flagged DOWNLOAD_FLAG_ABORTED, sent in place of the next
+  // packet.
+  void abortDownload(DownloadSession &session);
+
+  // Aborts all downloads from histories whose pinned range was overwritten
+  void finishInvalidatedDownloads();
+
+  // Size of one downloaded sample or aggregated record
+  [[nodiscard]] size_t downloadRecordSize(uint8_t tier) const;
+
+  // The slots of the requested ones that are part of the sample, 0 if all
+  // slots are requested
+  [[nodiscard]] uint16_t selectedSlots(uint16_t requestedSlotMask) const;
+
+  // Size of a record in the packets, only the selected slots are sent
+  [[nodiscard]] size_t sentRecordSize(const DownloadSession &session) const;
+
+  // Copies the selected slots of each sample of the record
+  void projectRecord(const DownloadSession &session, const uint8_t *record,
+                     uint8_t *destination) const;
+
+  // Applies the queued commands and stores the queued samples, must only be
+  // called while holding mSendingPackets
+  void processQueues();
+
+  // Called from the BLE stack's task
+  void queueCommand(const DownloadCommand &command);
+
+  void applyCommand(const DownloadCommand &command);
+
+  // Stores the sample without publishing the number of samples
+  void putSample(const Sample &sample, uint64_t timeStamp);
+
+  void updateNumberOfSamples();
+
+  // Sends packets of the sessions in turn until the burst limits are reached
+  void sendDownloadPackets();
+
+  // Advances the session's download by one packet, returns true if a packet
+  // was sent
+  bool sendNextDownloadPacket(DownloadSession &session);
+
+  // Ends the session's download if its packets could not be sent for too
+  // long
+  void onFailedSend(DownloadSession &session);
+  // Rewinds to the first unacknowledged packet or ends the download if the
+  // client did not acknowledge packets in time, returns true if rewound
+  bool onAckTimeout(DownloadSession &session);
+
+  void startDownload(DownloadSession &session);
+
+  [[nodiscard]] DownloadHeader
+  buildDownloadHeader(const DownloadSession &session) const;
+
+  DownloadPacket buildDownloadPacket(const DownloadSession &session);
+
+  static void onDownloadAck(DownloadSession &session,
+                            uint16_t nextExpectedSequenceIdx, bool retransmit);
+
+  // Moves the download back to the packet with the given sequence number
+  static void rewindDownload(DownloadSession &session, uint16_t sequenceIdx);
+
+  [[nodiscard]] size_t downloadPacketSizeForMtu(uint16_t mtu) const;
+
+  // Bytes of the pinned range sent in one packet
+  [[nodiscard]] size_t payloadSize(const DownloadSession &session) const;
 
-  DownloadPacket buildDownloadPacket();
+  [[nodiscard]] size_t samplesPerPacket(const DownloadSession &session) const;
 
   [[nodiscard]] uint32_t
-  numberOfPacketsRequired(uint32_t numberOfSamples) const;
+  numberOfPacketsRequired(const DownloadSession &session) const;
 };
 
 } // namespace sensirion::upt::ble_server
@@ -6,7 +6,7 @@ bool FrcBleService::begin() {
   mBleLibrary.createService(SCD_SERVICE_UUID);
   mBleLibrary.createCharacteristic(SCD_SERVICE_UUID, SCD_FRC_REQUEST_UUID,
                                    Permission::WRITE_PERMISSION);
-  mBleLibrary.characteristicSetValue(SCD_FRC_REQUEST_UUID, 0);
+  characteristicSetMessage(mBleLibrary, SCD_FRC_REQUEST_UUID, FrcRequest{});
   mBleLibrary.startService(SCD_SERVICE_UUID);
 
   return true;
@@ -16,13 +16,16 @@ void FrcBleService::registerFrcRequestCallback(
     // ReSharper disable once CppPassValueParameterByConstReference
     const frc_request_callback_t callback) // NOLINT(*-unnecessary-value-param)
     const {
-  auto onFRCRequest = [=](const std::string &value) {
-    // co2 level is encoded in lower two bytes, little endian
-    // the first two bytes are obfuscation and can be ignored
-    const uint16_t referenceCO2Level = value[2] | (value[3] << 8);
-    callback(referenceCO2Level);
+  auto onFRCRequest = [=](ConnectionHandle /*connection*/,
+                          const ByteView value) {
+    FrcRequest request;
+    if (!decodeMessage(value, request)) {
+      return;
+    }
+    callback(request.referenceCo2Level);
   };
 
+  // registered before begin creates the characteristic, so by UUID
   mBleLibrary.registerCharacteristicCallback(SCD_FRC_REQUEST_UUID,
                                              onFRCRequest);
 }
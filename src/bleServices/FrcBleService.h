@@ -2,12 +2,26 @@
 #define ARDUINO_UPT_BLE_SERVER_FRC_BLE_SERVICE_H
 
 #include "IBleServiceProvider.h"
+#include "WireCodec.h"
 
 namespace sensirion::upt::ble_server {
 
 constexpr auto SCD_SERVICE_UUID = "00007000-b38d-4985-720e-0f993a68ee41";
 constexpr auto SCD_FRC_REQUEST_UUID = "00007004-b38d-4985-720e-0f993a68ee41";
 
+// The first two bytes are obfuscation and can be ignored
+struct FrcRequest {
+  static constexpr size_t WIRE_SIZE = 4;
+  uint16_t obfuscation = 0;
+  uint16_t referenceCo2Level = 0;
+
+  template <typename Self, typename Visitor>
+  static constexpr void fields(Self &self, Visitor &visit) {
+    visit(self.obfuscation);
+    visit(self.referenceCo2Level);
+  }
+};
+
 using frc_request_callback_t = std::function<void(uint16_t)>;
 
 class FrcBleService final : public IBleServiceProvider {
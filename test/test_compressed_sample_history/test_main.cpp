@@ -0,0 +1,102 @@
+#include "CompressedSampleHistory.h"
+
+#include <cstdlib>
+#include <deque>
+#include <unity.h>
+#include <vector>
+
+using namespace sensirion::upt::ble_server;
+
+namespace {
+
+constexpr size_t SAMPLE_SIZE = 8;
+constexpr size_t ROUNDS = 200;
+
+using Record = std::vector<uint8_t>;
+using History = CompressedSampleHistory<1024, 64>;
+
+// Values mostly stay close to each other and compress to short deltas,
+// outliers need longer ones
+Record randomRecord() {
+  Record record(SAMPLE_SIZE);
+  for (size_t i = 0; i < SAMPLE_SIZE; i += 2) {
+    const auto value =
+        static_cast<uint16_t>(rand() % 8 == 0 ? rand() : 1000 + rand() % 5);
+    record[i] = value & 0xFF;
+    record[i + 1] = value >> 8;
+  }
+  return record;
+}
+
+void put(History &history, std::deque<Record> &reference,
+         const Record &record) {
+  Sample sample;
+  sample.setData(record.data(), SAMPLE_SIZE);
+  history.putSample(sample);
+  reference.push_back(record);
+}
+
+// The history must hold the newest samples in the order they were put
+void assertHistoryMatches(History &history,
+                          const std::deque<Record> &reference) {
+  const uint32_t count = history.numberOfSamplesInHistory();
+  TEST_ASSERT_TRUE(count > 0);
+  TEST_ASSERT_TRUE(count <= reference.size());
+  history.startReadOut(count);
+  for (size_t i = reference.size() - count; i < reference.size(); ++i) {
+    uint8_t data[SAMPLE_SIZE];
+    TEST_ASSERT_EQUAL(1, history.readOutNextSamples(data, 1));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(reference[i].data(), data, SAMPLE_SIZE);
+  }
+  history.endReadOut();
+}
+
+void test_samples_put_while_pinned_keep_their_order() {
+  srand(1);
+  History history;
+  history.setSampleSize(SAMPLE_SIZE);
+  std::deque<Record> reference;
+
+  for (size_t round = 0; round < ROUNDS; ++round) {
+    for (int i = rand() % 120; i > 0; --i) {
+      put(history, reference, randomRecord());
+    }
+    if (history.numberOfSamplesInHistory() == 0) {
+      continue;
+    }
+    // pinning the whole history makes every later sample wait
+    const uint32_t available = history.numberOfSamplesInHistory();
+    const auto requested = static_cast<uint32_t>(
+        rand() % 2 == 0 ? available : rand() % available + 1);
+    const std::deque<Record> pinned(reference.end() - requested,
+                                    reference.end());
+    history.startReadOut(requested);
+
+    // samples put during the read out either wait in the overflow buffer
+    // or, once that is full too, invalidate the pinned range
+    for (int i = rand() % 12; i > 0; --i) {
+      put(history, reference, randomRecord());
+    }
+    if (!history.readOutInvalidated()) {
+      for (const Record &expected : pinned) {
+        uint8_t data[SAMPLE_SIZE];
+        TEST_ASSERT_EQUAL(1, history.readOutNextSamples(data, 1));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), data, SAMPLE_SIZE);
+      }
+    }
+    history.endReadOut();
+    assertHistoryMatches(history, reference);
+  }
+}
+
+} // namespace
+
+void setUp() {}
+
+void tearDown() {}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_samples_put_while_pinned_keep_their_order);
+  return UNITY_END();
+}